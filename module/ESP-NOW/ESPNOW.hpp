@@ -11,9 +11,10 @@
 #include <WiFi.h>
 #include <esp_wifi.h>
 #include <esp_now.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
 #include <functional>
-#include <map>
-#include <list>
+#include <atomic>
 
 //默认数据包密钥
 #define DEFAULT_SECRET_KEY 0xFEFE
@@ -21,12 +22,103 @@
 //发送数据包失败最大重试次数
 #define MAX_RETRY 5
 
+//发送缓冲池大小,池满时发送函数立即返回ESP_ERR_NO_MEM
+#ifndef HXC_ESPNOW_TX_POOL_SIZE
+#define HXC_ESPNOW_TX_POOL_SIZE 16
+#endif
+
+//发送优先级,数字越小越优先,发送任务总是先发高优先级队列中的帧
+#define HXC_ESPNOW_PRIO_CONTROL 0//控制指令
+#define HXC_ESPNOW_PRIO_NORMAL 1//状态、遥测,默认优先级
+#define HXC_ESPNOW_PRIO_LOW 2//日志、大块数据,默认限速
+#define HXC_ESPNOW_PRIO_NUM 3
+
+//普通和低优先级最多占用的发送帧数,日志刷屏时控制指令仍有空闲帧
+#ifndef HXC_ESPNOW_TX_NORMAL_LIMIT
+#define HXC_ESPNOW_TX_NORMAL_LIMIT (HXC_ESPNOW_TX_POOL_SIZE*3/4)
+#endif
+#ifndef HXC_ESPNOW_TX_LOW_LIMIT
+#define HXC_ESPNOW_TX_LOW_LIMIT (HXC_ESPNOW_TX_POOL_SIZE/2)
+#endif
+
+//低优先级令牌桶的默认速率(帧/秒)和桶深(帧)
+#ifndef HXC_ESPNOW_LOW_RATE
+#define HXC_ESPNOW_LOW_RATE 200
+#endif
+#ifndef HXC_ESPNOW_LOW_BURST
+#define HXC_ESPNOW_LOW_BURST 16
+#endif
+
+//发送排队延时直方图的区间数,第i个区间为[125us*2^(i-1),125us*2^i),最后一个区间没有上限
+#define HXC_ESPNOW_LATENCY_BINS 8
+
+//等待发送完成回调的超时时间,单位ms
+#define HXC_ESPNOW_TX_TIMEOUT_MS 20
+
+//记录发送统计的最大设备数,与ESP-NOW最大配对数相同
+#define HXC_ESPNOW_MAX_PEER 20
+
+//按MAC查找的哈希表大小为2^HXC_ESPNOW_PEER_TABLE_BITS,需大于HXC_ESPNOW_MAX_PEER
+#define HXC_ESPNOW_PEER_TABLE_BITS 5
+#define HXC_ESPNOW_PEER_TABLE_SIZE (1<<HXC_ESPNOW_PEER_TABLE_BITS)
+
+//最多注册的主题数,不超过254
+#ifndef HXC_ESPNOW_MAX_TOPIC
+#define HXC_ESPNOW_MAX_TOPIC 64
+#endif
+
+//按主题ID查找的哈希表大小为2^HXC_ESPNOW_TOPIC_TABLE_BITS,需大于HXC_ESPNOW_MAX_TOPIC
+#ifndef HXC_ESPNOW_TOPIC_TABLE_BITS
+#define HXC_ESPNOW_TOPIC_TABLE_BITS 7
+#endif
+#define HXC_ESPNOW_TOPIC_TABLE_SIZE (1<<HXC_ESPNOW_TOPIC_TABLE_BITS)
+
+//接收缓冲池大小,必须是2的幂,回调处理不过来时丢弃新收到的数据包
+#ifndef HXC_ESPNOW_RX_POOL_SIZE
+#define HXC_ESPNOW_RX_POOL_SIZE 16
+#endif
+
+//超过该时间没有收到数据包认为设备断开,单位ms
+#ifndef HXC_ESPNOW_LINK_TIMEOUT_MS
+#define HXC_ESPNOW_LINK_TIMEOUT_MS 500
+#endif
+
+//到达间隔抖动直方图的区间数,第i个区间为[125us*2^(i-1),125us*2^i),最后一个区间没有上限
+#define HXC_ESPNOW_JITTER_BINS 8
+
+//v2数据包标识,位于v1格式name_len的位置
+#define HXC_ESPNOW_V2_MAGIC 0xA2
+
+//v2包头长度
+#define HXC_ESPNOW_HEADER_LEN 8
+
+//v2单个数据包最大数据长度
+#define HXC_ESPNOW_MAX_PAYLOAD (ESP_NOW_MAX_DATA_LEN-HXC_ESPNOW_HEADER_LEN)
+
+//v2标志位:可靠传输数据包,由ESPNOWReliable.hpp处理
+#define HXC_ESPNOW_FLAG_RELIABLE 0x01
+
+//v2标志位:分片数据包,由ESPNOWFragment.hpp处理
+#define HXC_ESPNOW_FLAG_FRAGMENT 0x02
+
+//v2标志位:可靠传输的应答,由ESPNOWReliable.hpp处理
+#define HXC_ESPNOW_FLAG_ACK 0x04
+
+//v2标志位:广播数据包,由发送任务设置,接收端对单播和广播分别统计丢包
+#define HXC_ESPNOW_FLAG_BROADCAST 0x08
+
+//需要扩展处理的标志位,没有设置处理函数时丢弃带这些标志的数据包
+#define HXC_ESPNOW_FLAG_EXT_MASK (HXC_ESPNOW_FLAG_RELIABLE|HXC_ESPNOW_FLAG_FRAGMENT|HXC_ESPNOW_FLAG_ACK)
+
 
 /*↓↓↓↓声明↓↓↓↓*/
 
 //数据包结构体
 struct HXC_ESPNOW_data_pakage;
 
+//数据包视图,直接指向接收缓冲区,不拷贝
+struct HXC_ESPNOW_view;
+
 //MAC地址结构体
 struct MAC_t{
   uint8_t mac[6];
@@ -53,6 +145,27 @@ MAC_t broadcastMacAddress(0xFF,0xFF,0xFF,0xFF,0xFF,0xFF);
 //回调函数
 using callback_func =std::function<void(HXC_ESPNOW_data_pakage)>;
 
+//主题回调函数,参数只在回调期间有效
+using topic_callback_func =std::function<void(const HXC_ESPNOW_view&)>;
+
+//FNV-1a哈希,constexpr
+constexpr uint32_t ESPNOW_HASH32(const char* str,uint32_t hash=2166136261u){
+  return *str?ESPNOW_HASH32(str+1,(hash^uint8_t(*str))*16777619u):hash;
+}
+
+//32位哈希折叠为16位
+constexpr uint16_t ESPNOW_HASH_FOLD(uint32_t hash){
+  return uint16_t((hash>>16)^(hash&0xFFFF));
+}
+
+/**
+ * @description: 由数据包名称计算16位主题ID,名称为字符串常量时在编译期求值
+ * @param {const char*} name 数据包名称
+ */
+constexpr uint16_t ESPNOW_TOPIC_ID(const char* name){
+  return ESPNOW_HASH_FOLD(ESPNOW_HASH32(name));
+}
+
 
 /**
  * @description: ESP-NOW初始化
@@ -74,15 +187,28 @@ bool is_esp_now_peer(MAC_t mac);
 
 
 /**
- * @description: 发送经过封装的ESP-NOW数据包
- * @return {esp_err_t} 正确返回ESP_OK
+ * @description: 发送经过封装的ESP-NOW数据包,只放入发送队列,不阻塞
+ * @return {esp_err_t} 成功放入发送队列返回ESP_OK,队列满返回ESP_ERR_NO_MEM
  * @Author: qingmeijiupiao
  * @param {String} name 数据包名称
  * @param {uint8_t*} data 数据
  * @param {int} datalen 数据长度
  * @param {MAC_t} receive_MAC 接收数据的设备MAC 默认广播地址
+ * @param {uint8_t} priority 发送优先级,HXC_ESPNOW_PRIO_CONTROL/NORMAL/LOW
+ */
+esp_err_t esp_now_send_package(String name,uint8_t* data,int datalen,MAC_t receive_MAC=broadcastMacAddress,uint8_t priority=HXC_ESPNOW_PRIO_NORMAL);
+
+/**
+ * @description: 按主题ID发送v2数据包,不构造String,只放入发送队列,不阻塞
+ * @return {esp_err_t} 成功放入发送队列返回ESP_OK,数据过长返回ESP_ERR_INVALID_SIZE,队列满返回ESP_ERR_NO_MEM
+ * @param {uint16_t} topic_id 主题ID,一般用ESPNOW_TOPIC_ID("名称")
+ * @param {const uint8_t*} data 数据
+ * @param {int} datalen 数据长度,不超过HXC_ESPNOW_MAX_PAYLOAD
+ * @param {MAC_t} receive_MAC 接收数据的设备MAC 默认广播地址
+ * @param {uint8_t} flags 包头标志位
+ * @param {uint8_t} priority 发送优先级,HXC_ESPNOW_PRIO_CONTROL/NORMAL/LOW
  */
-esp_err_t esp_now_send_package(String name,uint8_t* data,int datalen,MAC_t receive_MAC=broadcastMacAddress);
+esp_err_t esp_now_send_topic(uint16_t topic_id,const uint8_t* data,int datalen,MAC_t receive_MAC=broadcastMacAddress,uint8_t flags=0,uint8_t priority=HXC_ESPNOW_PRIO_NORMAL);
 
 
 /**
@@ -97,9 +223,138 @@ void add_esp_now_callback(String package_name,callback_func func);
 //移除回调函数
 void remove_esp_now_callback(String package_name);
 
+/**
+ * @description: 添加主题回调,收到该主题的v1或v2数据包时调用,数据不拷贝
+ * @param {uint16_t} topic_id 主题ID
+ * @param {topic_callback_func} func 回调函数
+ */
+void add_esp_now_topic_callback(uint16_t topic_id,topic_callback_func func);
+
+//移除主题回调
+void remove_esp_now_topic_callback(uint16_t topic_id);
+
 //修改数据包密钥
 void change_secret_key(uint16_t _secret_key);
 
+//设置esp_now_send_package的发送格式,1为旧版名称格式(默认,未升级的设备也能解析),2为主题ID格式(所有接收端升级后使用)
+void esp_now_set_send_version(uint8_t version);
+
+/**
+ * @description: 设置接收分发任务,需在esp_now_setup之前调用
+ * @param {UBaseType_t} priority 分发任务优先级,回调函数在该任务中运行
+ * @param {BaseType_t} core 运行的核心,默认不绑定
+ */
+void esp_now_set_dispatcher(UBaseType_t priority,BaseType_t core=tskNO_AFFINITY);
+
+//接收统计
+struct HXC_ESPNOW_rx_stats_t {
+  uint32_t received;//通过校验进入队列的数据包数
+  uint32_t dropped;//缓冲池满丢弃的数据包数
+  uint32_t depth;//当前等待分发的数据包数
+  uint32_t max_depth;//等待分发的最大数据包数
+};
+
+//获取接收统计
+HXC_ESPNOW_rx_stats_t esp_now_get_rx_stats();
+
+/**
+ * @description: 设置发送任务,需在esp_now_setup之前调用
+ * @param {UBaseType_t} priority 发送任务优先级
+ * @param {BaseType_t} core 运行的核心,默认不绑定
+ */
+void esp_now_set_sender(UBaseType_t priority,BaseType_t core=tskNO_AFFINITY);
+
+/**
+ * @description: 设置发送完成回调,每个数据包发送完成后在发送任务中调用
+ * @param func 回调函数,参数为接收方MAC和是否发送成功,广播包总是成功
+ */
+void esp_now_set_send_callback(std::function<void(const uint8_t*,bool)> func);
+
+//发送统计
+struct HXC_ESPNOW_tx_stats_t {
+  uint32_t queued;//放入发送队列的数据包数
+  uint32_t dropped;//发送队列满丢弃的数据包数
+  uint32_t depth;//当前等待发送的数据包数
+  uint32_t success;//发送成功数(收到对方MAC层应答)
+  uint32_t fail;//发送失败数
+};
+
+//获取总发送统计
+HXC_ESPNOW_tx_stats_t esp_now_get_tx_stats();
+
+//获取发往指定设备的发送统计,只有success和fail有效
+HXC_ESPNOW_tx_stats_t esp_now_get_tx_stats(MAC_t mac);
+
+//单个优先级的发送统计
+struct HXC_ESPNOW_prio_stats_t {
+  uint32_t queued;//放入发送队列的数据包数
+  uint32_t dropped;//没有空闲帧丢弃的数据包数
+  uint32_t sent;//交给无线电的数据包数
+  uint32_t depth;//当前等待发送的数据包数
+  uint32_t latency_avg_us;//从放入队列到交给无线电的排队延时,滑动平均
+  uint32_t latency_max_us;//排队延时最大值
+  uint32_t latency_hist[HXC_ESPNOW_LATENCY_BINS];//排队延时直方图
+};
+
+//获取某个优先级的发送统计
+HXC_ESPNOW_prio_stats_t esp_now_get_priority_stats(uint8_t priority);
+
+//清零各优先级的发送统计
+void esp_now_reset_priority_stats();
+
+/**
+ * @description: 设置某个优先级的令牌桶限速,低优先级默认HXC_ESPNOW_LOW_RATE帧/秒
+ * @param {uint8_t} priority 发送优先级
+ * @param {uint32_t} rate 平均速率,帧/秒,0为不限速
+ * @param {uint32_t} burst 桶深,允许连续发送的帧数
+ */
+void esp_now_set_priority_rate(uint8_t priority,uint32_t rate,uint32_t burst);
+
+//单个设备的链路质量
+struct HXC_ESPNOW_link_stats_t {
+  int64_t last_seen_us;//最近收到数据包的时间,esp_timer_get_time()
+  bool connected;//断线超时内收到过数据包
+  int8_t rssi;//最近一个数据包的信号强度,dBm,未开启RSSI统计时为0
+  float rssi_avg;//信号强度滑动平均
+  uint32_t received;//收到的数据包数
+  uint32_t lost;//按序号间隔推算的丢包数
+  float loss_rate;//丢包率
+  int32_t rtt_us;//最近一次ping的往返时间,没有ping过为0
+  int32_t rtt_avg_us;//往返时间滑动平均
+  float jitter_us;//到达间隔抖动,RFC3550算法
+  uint32_t jitter_hist[HXC_ESPNOW_JITTER_BINS];//相邻两次到达间隔之差的直方图
+};
+
+/**
+ * @description: 获取设备的链路质量,不加锁,可在控制任务中频繁调用
+ * @return {bool} 收到过该设备的数据包返回true
+ * @param {MAC_t} mac 设备MAC
+ * @param {HXC_ESPNOW_link_stats_t&} stats 链路质量
+ */
+bool esp_now_get_link_stats(MAC_t mac,HXC_ESPNOW_link_stats_t& stats);
+
+//设备是否在断线超时内发来过数据包
+bool esp_now_is_connected(MAC_t mac);
+
+//是否有任意设备在断线超时内发来过数据包
+bool esp_now_is_connected();
+
+//设置断线超时,单位ms
+void esp_now_set_link_timeout(uint32_t timeout_ms);
+
+/**
+ * @description: 开启RSSI统计,使用WiFi混杂模式读取ESP-NOW帧的接收信号强度,需在esp_now_setup之后调用
+ * @param {bool} enable 是否开启,混杂模式会增加WiFi任务的CPU占用
+ */
+void esp_now_enable_rssi(bool enable=true);
+
+/**
+ * @description: 发送ping,对方的ESP-NOW库收到后立即回复,回复到达时更新该设备的往返时间
+ * @return {esp_err_t} 与esp_now_send_topic相同
+ * @param {MAC_t} mac 目标设备,广播地址时所有设备都会回复
+ */
+esp_err_t esp_now_ping(MAC_t mac=broadcastMacAddress);
+
 
 
 
@@ -113,20 +368,116 @@ void change_secret_key(uint16_t _secret_key);
 //数据包密钥
 static uint16_t secret_key=DEFAULT_SECRET_KEY;
 
+/*
+ * v2包头,小端,共8字节:
+ *   密钥(2) | 0xA2(1) | 标志(1) | 主题ID(2) | 序号(1) | 数据长度(1)
+ * v1格式第3个字节是名称长度,总长度为4+名称长度+数据长度,
+ * 接收时v2格式要求标识和总长度同时吻合,否则按v1解析
+ */
+struct __attribute__((packed)) HXC_ESPNOW_header_t {
+  uint16_t key;
+  uint8_t magic;
+  uint8_t flags;
+  uint16_t topic_id;
+  uint8_t seq;
+  uint8_t len;
+};
+static_assert(sizeof(HXC_ESPNOW_header_t)==HXC_ESPNOW_HEADER_LEN,"HXC_ESPNOW_header_t size error");
+
+//数据包视图
+struct HXC_ESPNOW_view {
+  const uint8_t* mac=nullptr;//发送方MAC
+  uint8_t version=2;//数据包格式版本
+  uint8_t flags=0;//包头标志位,v1为0
+  uint16_t topic_id=0;//主题ID,v1由名称计算
+  uint8_t seq=0;//序号,v1为0
+  const char* name=nullptr;//v1数据包的名称,不以'\0'结尾,v2为nullptr
+  uint8_t name_len=0;
+  const uint8_t* data=nullptr;//数据,指向接收缓冲区
+  uint16_t data_len=0;//分片重组后的消息可以超过单包长度
+  int64_t rx_us=0;//接收回调中记录的到达时间
+};
+
+//运行时计算主题ID,与ESPNOW_TOPIC_ID结果相同
+static uint16_t esp_now_topic_id(const char* name,size_t len){
+  uint32_t hash=2166136261u;
+  for(size_t i=0;i<len;i++){
+    hash=(hash^uint8_t(name[i]))*16777619u;
+  }
+  return ESPNOW_HASH_FOLD(hash);
+}
+
+/**
+ * @description: 编码v2数据包
+ * @return {int} 数据包长度,数据过长返回-1
+ * @param {uint8_t*} out 输出缓冲区,至少HXC_ESPNOW_HEADER_LEN+datalen字节
+ * @param {const uint8_t*} data 数据,可以已经写在out+HXC_ESPNOW_HEADER_LEN处,此时不拷贝
+ */
+static int esp_now_encode(uint8_t* out,uint16_t topic_id,const uint8_t* data,int datalen,uint8_t seq,uint8_t flags=0){
+  if(datalen<0||datalen>HXC_ESPNOW_MAX_PAYLOAD) return -1;
+  HXC_ESPNOW_header_t header;
+  header.key=secret_key;
+  header.magic=HXC_ESPNOW_V2_MAGIC;
+  header.flags=flags;
+  header.topic_id=topic_id;
+  header.seq=seq;
+  header.len=datalen;
+  memcpy(out,&header,HXC_ESPNOW_HEADER_LEN);
+  if(data!=out+HXC_ESPNOW_HEADER_LEN) memcpy(out+HXC_ESPNOW_HEADER_LEN,data,datalen);
+  return HXC_ESPNOW_HEADER_LEN+datalen;
+}
+
+/**
+ * @description: 原地解码v1或v2数据包,不拷贝数据
+ * @return {bool} 密钥正确且格式有效返回true
+ * @param {const uint8_t*} frame 接收到的数据
+ * @param {int} len 数据长度
+ * @param {HXC_ESPNOW_view&} view 解码结果,指针指向frame
+ */
+static bool esp_now_decode_view(const uint8_t* frame,int len,HXC_ESPNOW_view& view){
+  if(len<4||len>ESP_NOW_MAX_DATA_LEN) return false;
+  if(uint16_t(frame[0]|(frame[1]<<8))!=secret_key) return false;
+  if(len>=HXC_ESPNOW_HEADER_LEN&&frame[2]==HXC_ESPNOW_V2_MAGIC&&len==HXC_ESPNOW_HEADER_LEN+frame[7]){
+    view.version=2;
+    view.flags=frame[3];
+    view.topic_id=uint16_t(frame[4]|(frame[5]<<8));
+    view.seq=frame[6];
+    view.name=nullptr;
+    view.name_len=0;
+    view.data=frame+HXC_ESPNOW_HEADER_LEN;
+    view.data_len=frame[7];
+    return true;
+  }
+  if(len==4+frame[2]+frame[3]){
+    view.version=1;
+    view.flags=0;
+    view.seq=0;
+    view.name=(const char*)frame+4;
+    view.name_len=frame[2];
+    view.topic_id=esp_now_topic_id(view.name,view.name_len);
+    view.data=frame+4+frame[2];
+    view.data_len=frame[3];
+    return true;
+  }
+  return false;
+}
+
 //数据包格式
 struct HXC_ESPNOW_data_pakage {
   uint16_t header_code=secret_key;//数据包头,作为密钥使用
   uint8_t name_len;
   uint8_t data_len;
   String package_name;
-  uint8_t data[256];
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
   //添加名字
   void add_name(String _name){
     package_name=_name;
     name_len=package_name.length();
   }
-  //添加数据
+  //添加数据,超出单包长度的部分被截断
   void add_data(uint8_t* _data,int _datalen){
+    if(_datalen>ESP_NOW_MAX_DATA_LEN-4-name_len) _datalen=ESP_NOW_MAX_DATA_LEN-4-name_len;
+    if(_datalen<0) _datalen=0;
     data_len=_datalen;
     for(int i=0;i<_datalen;i++){
       data[i]=_data[i];
@@ -144,9 +495,14 @@ struct HXC_ESPNOW_data_pakage {
 
   //解码数组到结构体对象
   void decode(uint8_t* _data,int _datalen){
+    if(_datalen<4) return;
     header_code=*((uint16_t*)_data);
     name_len=_data[2];
     data_len=_data[3];
+    if(4+name_len+data_len>_datalen){
+      name_len=0;
+      data_len=0;
+    }
     package_name="";
     for(int i=0;i<name_len;i++){
       package_name+=char(_data[4+i]);
@@ -155,6 +511,14 @@ struct HXC_ESPNOW_data_pakage {
       data[i]=_data[4+name_len+i];
     }
   }
+  //从数据包视图构造,v2数据包没有名称,使用注册回调时的名称,超出单包长度的部分被截断
+  void from_view(const HXC_ESPNOW_view& view,const String& name){
+    header_code=secret_key;
+    package_name=name;
+    name_len=package_name.length();
+    data_len=view.data_len<=ESP_NOW_MAX_DATA_LEN-4-name_len?view.data_len:ESP_NOW_MAX_DATA_LEN-4-name_len;
+    memcpy(data,view.data,data_len);
+  }
   //获取数据包长度
   int get_len(){
     return 4+name_len+data_len;
@@ -163,36 +527,653 @@ struct HXC_ESPNOW_data_pakage {
 };
 
 
-static std::list<MAC_t> peer_mac_list;//配对MAC地址列表
+static_assert(HXC_ESPNOW_PEER_TABLE_SIZE>HXC_ESPNOW_MAX_PEER,"HXC_ESPNOW_PEER_TABLE_BITS too small");
+static_assert(HXC_ESPNOW_MAX_TOPIC<255&&HXC_ESPNOW_TOPIC_TABLE_SIZE>HXC_ESPNOW_MAX_TOPIC,"HXC_ESPNOW_TOPIC_TABLE_BITS too small");
+
+//MAC转为哈希表的键,第48位标记有效,0表示空位
+static inline uint64_t esp_now_mac_key(const uint8_t* mac){
+  uint32_t low=mac[0]|(mac[1]<<8)|(mac[2]<<16)|(uint32_t(mac[3])<<24);
+  uint32_t high=mac[4]|(mac[5]<<8)|(1u<<16);
+  return (uint64_t(high)<<32)|low;
+}
+
+//MAC在哈希表中的起始位置,同一厂商的MAC前3字节相同,把高低位混合后再做乘法哈希
+static inline uint32_t esp_now_mac_slot(uint64_t key){
+  uint32_t h=uint32_t(key)^uint32_t(key>>16);
+  return (h*2654435769u)>>(32-HXC_ESPNOW_PEER_TABLE_BITS);
+}
+
+//主题ID在哈希表中的起始位置
+static inline uint32_t esp_now_topic_slot(uint16_t topic_id){
+  return (uint32_t(topic_id)*2654435769u)>>(32-HXC_ESPNOW_TOPIC_TABLE_BITS);
+}
+
+//配对MAC集合,开放寻址线性探测,删除时后移补位,不使用墓碑
+static uint64_t peer_mac_table[HXC_ESPNOW_PEER_TABLE_SIZE];
+static int peer_mac_num=0;
+static portMUX_TYPE peer_mac_lock=portMUX_INITIALIZER_UNLOCKED;
+
+//一个主题的回调
+struct HXC_ESPNOW_callback_t {
+  uint16_t topic_id;
+  String name;//注册时的名称,v1数据包用于校验,ID冲突时不调用
+  callback_func func=nullptr;//旧版回调
+  topic_callback_func topic_func=nullptr;//主题回调
+};
+
+//已注册的主题,前callback_num项有效,删除时把最后一项移到空位
+static HXC_ESPNOW_callback_t callback_pool[HXC_ESPNOW_MAX_TOPIC];
+static int callback_num=0;
+//主题哈希表,值为callback_pool下标+1,0表示空位,接收时按主题ID查找不分配内存
+static uint8_t callback_index[HXC_ESPNOW_TOPIC_TABLE_SIZE];
+
+//查找主题在哈希表中的位置,没有时返回-1
+static int esp_now_callback_slot(uint16_t topic_id){
+  uint32_t slot=esp_now_topic_slot(topic_id);
+  while(callback_index[slot]!=0){
+    if(callback_pool[callback_index[slot]-1].topic_id==topic_id) return slot;
+    slot=(slot+1)&(HXC_ESPNOW_TOPIC_TABLE_SIZE-1);
+  }
+  return -1;
+}
+
+//查找主题的回调,没有时添加,表满返回nullptr
+static HXC_ESPNOW_callback_t* esp_now_callback_get(uint16_t topic_id){
+  uint32_t slot=esp_now_topic_slot(topic_id);
+  while(callback_index[slot]!=0){
+    HXC_ESPNOW_callback_t& item=callback_pool[callback_index[slot]-1];
+    if(item.topic_id==topic_id) return &item;
+    slot=(slot+1)&(HXC_ESPNOW_TOPIC_TABLE_SIZE-1);
+  }
+  if(callback_num>=HXC_ESPNOW_MAX_TOPIC){
+    log_e("ESP-NOW: too many topics, increase HXC_ESPNOW_MAX_TOPIC");
+    return nullptr;
+  }
+  HXC_ESPNOW_callback_t& item=callback_pool[callback_num++];
+  item.topic_id=topic_id;
+  callback_index[slot]=callback_num;
+  return &item;
+}
 
-static std::map<String, callback_func> callback_map;//回调函数map
+//删除哈希表slot位置的主题
+static void esp_now_callback_erase(int slot){
+  const uint32_t mask=HXC_ESPNOW_TOPIC_TABLE_SIZE-1;
+  int index=callback_index[slot]-1;
+  //后移补位:探测链上起始位置不在(hole,next]之间的项前移到空位
+  uint32_t hole=slot;
+  for(uint32_t next=(hole+1)&mask;callback_index[next]!=0;next=(next+1)&mask){
+    uint32_t home=esp_now_topic_slot(callback_pool[callback_index[next]-1].topic_id);
+    if(((next-home)&mask)>=((next-hole)&mask)){
+      callback_index[hole]=callback_index[next];
+      hole=next;
+    }
+  }
+  callback_index[hole]=0;
+  //把最后一项移到空出的位置,保持回调池紧凑
+  int last=callback_num-1;
+  if(index!=last){
+    callback_index[esp_now_callback_slot(callback_pool[last].topic_id)]=index+1;
+    callback_pool[index]=callback_pool[last];
+  }
+  callback_pool[last].name="";
+  callback_pool[last].func=nullptr;
+  callback_pool[last].topic_func=nullptr;
+  callback_num--;
+}
 
 //添加回调函数
 void add_esp_now_callback(String package_name,callback_func func){
-  callback_map[package_name]=func;
+  HXC_ESPNOW_callback_t* item=esp_now_callback_get(esp_now_topic_id(package_name.c_str(),package_name.length()));
+  if(item==nullptr) return;
+  if(item->name.length()!=0&&item->name!=package_name){
+    log_w("ESP-NOW: topic id of %s conflicts with %s",package_name.c_str(),item->name.c_str());
+  }
+  item->name=package_name;
+  item->func=func;
 }
 
 //移除回调函数
 void remove_esp_now_callback(String package_name){
-  callback_map.erase(package_name);
+  int slot=esp_now_callback_slot(esp_now_topic_id(package_name.c_str(),package_name.length()));
+  if(slot<0) return;
+  HXC_ESPNOW_callback_t& item=callback_pool[callback_index[slot]-1];
+  item.func=nullptr;
+  if(!item.topic_func) esp_now_callback_erase(slot);
+};
+
+//添加主题回调
+void add_esp_now_topic_callback(uint16_t topic_id,topic_callback_func func){
+  HXC_ESPNOW_callback_t* item=esp_now_callback_get(topic_id);
+  if(item!=nullptr) item->topic_func=func;
+}
+
+//移除主题回调
+void remove_esp_now_topic_callback(uint16_t topic_id){
+  int slot=esp_now_callback_slot(topic_id);
+  if(slot<0) return;
+  HXC_ESPNOW_callback_t& item=callback_pool[callback_index[slot]-1];
+  item.topic_func=nullptr;
+  if(!item.func) esp_now_callback_erase(slot);
+}
+
+static HXC_ESPNOW_data_pakage re_data;//数据包缓存对象,仅旧版回调使用,只在分发任务中访问
+
+//单个设备的链路统计,除往返时间外只在WiFi任务中写入,读取时用版本号检查,不加锁
+struct HXC_ESPNOW_link_t {
+  std::atomic<bool> used;
+  uint64_t key;//esp_now_mac_key(mac)
+  std::atomic<uint32_t> version;//写入期间为奇数
+  int64_t last_seen_us;
+  int64_t last_interval_us;
+  int8_t rssi;
+  float rssi_avg;
+  uint32_t received;
+  uint32_t lost;
+  uint8_t last_seq[2];//单播和广播分别编号
+  bool has_seq[2];
+  float jitter_us;
+  uint32_t jitter_hist[HXC_ESPNOW_JITTER_BINS];
+  std::atomic<int32_t> rtt_us;//由分发任务写入
+  std::atomic<int32_t> rtt_avg_us;
+};
+
+static HXC_ESPNOW_link_t link_stats[HXC_ESPNOW_PEER_TABLE_SIZE];//链路统计哈希表,只在WiFi任务中添加,表项不删除
+static int link_num=0;
+static uint32_t link_timeout_us=HXC_ESPNOW_LINK_TIMEOUT_MS*1000;
+static std::atomic<int64_t> last_receive_us{0};//任意设备最近发来数据包的时间
+
+//混杂模式回调记录的最近一个ESP-NOW帧,与接收回调都在WiFi任务中运行
+static uint8_t promiscuous_mac[6];
+static int8_t promiscuous_rssi=0;
+static bool rssi_enabled=false;
+
+//查找设备的链路统计,表项只增不删,遇到空位即可确定不存在
+static HXC_ESPNOW_link_t* esp_now_link_find(const uint8_t* mac){
+  uint64_t key=esp_now_mac_key(mac);
+  for(uint32_t slot=esp_now_mac_slot(key);link_stats[slot].used.load(std::memory_order_acquire);slot=(slot+1)&(HXC_ESPNOW_PEER_TABLE_SIZE-1)){
+    if(link_stats[slot].key==key) return &link_stats[slot];
+  }
+  return nullptr;
+}
+
+//收到数据包时更新链路统计,在WiFi任务中运行
+static void esp_now_link_update(const uint8_t* mac,const HXC_ESPNOW_view& view){
+  int64_t now=esp_timer_get_time();
+  last_receive_us.store(now,std::memory_order_relaxed);
+  HXC_ESPNOW_link_t* link=esp_now_link_find(mac);
+  if(link==nullptr){
+    if(link_num>=HXC_ESPNOW_MAX_PEER) return;
+    uint64_t key=esp_now_mac_key(mac);
+    uint32_t slot=esp_now_mac_slot(key);
+    while(link_stats[slot].used.load(std::memory_order_relaxed)) slot=(slot+1)&(HXC_ESPNOW_PEER_TABLE_SIZE-1);
+    link=&link_stats[slot];
+    link->key=key;
+    link->used.store(true,std::memory_order_release);
+    link_num++;
+  }
+  link->version.fetch_add(1,std::memory_order_acq_rel);
+  if(link->received>0){
+    int64_t interval=now-link->last_seen_us;
+    if(link->received>1){
+      int64_t d=interval-link->last_interval_us;
+      if(d<0) d=-d;
+      link->jitter_us+=(float(d)-link->jitter_us)/16.f;
+      int bin=0;
+      while(bin<HXC_ESPNOW_JITTER_BINS-1&&d>=(int64_t(125)<<bin)) bin++;
+      link->jitter_hist[bin]++;
+    }
+    link->last_interval_us=interval;
+  }
+  link->last_seen_us=now;
+  link->received++;
+  if(view.version==2){
+    int stream=(view.flags&HXC_ESPNOW_FLAG_BROADCAST)?1:0;
+    if(link->has_seq[stream]){
+      //序号间隔超过一半认为是乱序或对方重启,不计入丢包
+      uint8_t gap=uint8_t(view.seq-link->last_seq[stream]-1);
+      if(gap<128) link->lost+=gap;
+    }
+    link->last_seq[stream]=view.seq;
+    link->has_seq[stream]=true;
+  }
+  if(rssi_enabled&&memcmp(promiscuous_mac,mac,6)==0){
+    link->rssi=promiscuous_rssi;
+    link->rssi_avg=link->rssi_avg==0?promiscuous_rssi:link->rssi_avg+(promiscuous_rssi-link->rssi_avg)/8.f;
+  }
+  link->version.fetch_add(1,std::memory_order_release);
+}
+
+//混杂模式回调,只记录ESP-NOW帧的源地址和信号强度
+static void esp_now_promiscuous_cb(void* buf,wifi_promiscuous_pkt_type_t type){
+  if(type!=WIFI_PKT_MGMT) return;
+  const wifi_promiscuous_pkt_t* pkt=(const wifi_promiscuous_pkt_t*)buf;
+  const uint8_t* frame=pkt->payload;
+  //ESP-NOW是厂商自定义的Action帧:帧类型0xD0,类别127,乐鑫OUI 18:FE:34
+  if(pkt->rx_ctrl.sig_len<28||frame[0]!=0xD0||frame[24]!=127||frame[25]!=0x18||frame[26]!=0xFE||frame[27]!=0x34) return;
+  memcpy(promiscuous_mac,frame+10,6);
+  promiscuous_rssi=pkt->rx_ctrl.rssi;
+}
+
+//获取设备的链路质量
+bool esp_now_get_link_stats(MAC_t mac,HXC_ESPNOW_link_stats_t& stats){
+  HXC_ESPNOW_link_t* link=esp_now_link_find(mac);
+  if(link==nullptr) return false;
+  uint32_t version;
+  do{
+    version=link->version.load(std::memory_order_acquire);
+    if(version&1) continue;
+    stats.last_seen_us=link->last_seen_us;
+    stats.rssi=link->rssi;
+    stats.rssi_avg=link->rssi_avg;
+    stats.received=link->received;
+    stats.lost=link->lost;
+    stats.jitter_us=link->jitter_us;
+    memcpy(stats.jitter_hist,link->jitter_hist,sizeof(stats.jitter_hist));
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }while((version&1)||link->version.load(std::memory_order_relaxed)!=version);
+  stats.rtt_us=link->rtt_us.load(std::memory_order_relaxed);
+  stats.rtt_avg_us=link->rtt_avg_us.load(std::memory_order_relaxed);
+  stats.loss_rate=stats.received+stats.lost?float(stats.lost)/float(stats.received+stats.lost):0.f;
+  stats.connected=esp_timer_get_time()-stats.last_seen_us<link_timeout_us;
+  return true;
+}
+
+//设备是否在断线超时内发来过数据包
+bool esp_now_is_connected(MAC_t mac){
+  HXC_ESPNOW_link_t* link=esp_now_link_find(mac);
+  if(link==nullptr) return false;
+  uint32_t version;
+  int64_t last_seen;
+  do{
+    version=link->version.load(std::memory_order_acquire);
+    last_seen=link->last_seen_us;
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }while((version&1)||link->version.load(std::memory_order_relaxed)!=version);
+  return esp_timer_get_time()-last_seen<link_timeout_us;
+}
+
+//是否有任意设备在断线超时内发来过数据包
+bool esp_now_is_connected(){
+  int64_t last=last_receive_us.load(std::memory_order_relaxed);
+  return last!=0&&esp_timer_get_time()-last<link_timeout_us;
+}
+
+//设置断线超时
+void esp_now_set_link_timeout(uint32_t timeout_ms){
+  link_timeout_us=timeout_ms*1000;
+}
+
+//开启RSSI统计
+void esp_now_enable_rssi(bool enable){
+  if(enable){
+    wifi_promiscuous_filter_t filter={WIFI_PROMIS_FILTER_MASK_MGMT};
+    esp_wifi_set_promiscuous_filter(&filter);
+    esp_wifi_set_promiscuous_rx_cb(esp_now_promiscuous_cb);
+  }
+  rssi_enabled=enable;
+  esp_wifi_set_promiscuous(enable);
+}
+
+//是否连接,任意设备在断线超时内发来过数据包时为true,兼容旧代码,新代码使用esp_now_is_connected
+struct HXC_ESPNOW_connected_t {
+  operator bool() const { return esp_now_is_connected(); }
+};
+HXC_ESPNOW_connected_t is_conect;
+
+//标志位处理函数,按位从低到高处理,处理函数去掉自己的标志位后再调用esp_now_dispatch
+using flag_handler_func =void(*)(const HXC_ESPNOW_view&);
+static flag_handler_func flag_handlers[8]={nullptr};
+
+/**
+ * @description: 设置标志位处理函数,供分片等扩展使用
+ * @param {uint8_t} flag 标志位,只能有一位
+ * @param {flag_handler_func} handler 处理函数,在分发任务中调用
+ */
+void esp_now_set_flag_handler(uint8_t flag,flag_handler_func handler){
+  for(int i=0;i<8;i++){
+    if(flag==(1<<i)) flag_handlers[i]=handler;
+  }
+}
+
+//调用数据包对应的回调
+static void esp_now_dispatch(const HXC_ESPNOW_view& view){
+  if(view.flags&HXC_ESPNOW_FLAG_EXT_MASK){
+    for(int i=0;i<8;i++){
+      if(!(view.flags&HXC_ESPNOW_FLAG_EXT_MASK&(1<<i))) continue;
+      if(flag_handlers[i]!=nullptr) flag_handlers[i](view);
+      return;
+    }
+  }
+  int slot=esp_now_callback_slot(view.topic_id);
+  if(slot<0) return;
+  HXC_ESPNOW_callback_t& callback=callback_pool[callback_index[slot]-1];
+  //v1数据包带名称,名称与注册的不同说明是主题ID冲突
+  if(view.version==1&&callback.name.length()!=0){
+    if(callback.name.length()!=view.name_len||memcmp(callback.name.c_str(),view.name,view.name_len)!=0) return;
+  }
+  if(callback.topic_func){
+    callback.topic_func(view);
+  }
+  if(callback.func){
+    re_data.from_view(view,callback.name);
+    callback.func(re_data);
+  }
+}
+
+//接收缓冲池中的一帧
+struct HXC_ESPNOW_rx_frame_t {
+  int64_t rx_us;
+  uint8_t mac[6];
+  uint8_t len;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
 };
 
-static HXC_ESPNOW_data_pakage re_data;//数据包缓存对象
+//接收缓冲池,WiFi任务写入,分发任务读取,单生产者单消费者无锁环形队列
+static HXC_ESPNOW_rx_frame_t rx_pool[HXC_ESPNOW_RX_POOL_SIZE];
+static std::atomic<uint32_t> rx_head{0};
+static std::atomic<uint32_t> rx_tail{0};
+static volatile uint32_t rx_received=0;
+static volatile uint32_t rx_dropped=0;
+static volatile uint32_t rx_max_depth=0;
 
-//是否连接的标志
-bool is_conect=false;
+//分发任务
+static TaskHandle_t dispatcher_handle=nullptr;
+static UBaseType_t dispatcher_priority=5;
+static BaseType_t dispatcher_core=tskNO_AFFINITY;
 
-//接收数据时的回调函数，收到数据时自动运行
+//接收数据时的回调函数，在WiFi任务中运行,只校验并拷贝到缓冲池,回调在分发任务中调用
 void OnESPNOWDataRecv(const uint8_t *mac, const uint8_t *data, int len) {
+  //尽早记录到达时间,时间同步用
+  int64_t rx_us=esp_timer_get_time();
   //检查是否是数据包
-  if(len<4) return;
-  if(*(uint16_t*)data!=secret_key) return;
-  re_data.decode((uint8_t*)data,len);
-    //检查是否是需要运行回调函数的数据包
-  if(callback_map.count( re_data.package_name )!=0){
-    callback_map[re_data.package_name](re_data);
+  HXC_ESPNOW_view view;
+  if(!esp_now_decode_view(data,len,view)) return;
+  esp_now_link_update(mac,view);
+  uint32_t head=rx_head.load(std::memory_order_relaxed);
+  uint32_t depth=head-rx_tail.load(std::memory_order_acquire);
+  if(depth>=HXC_ESPNOW_RX_POOL_SIZE){
+    rx_dropped++;
+    return;
   }
-  is_conect=true;
+  HXC_ESPNOW_rx_frame_t& frame=rx_pool[head&(HXC_ESPNOW_RX_POOL_SIZE-1)];
+  frame.rx_us=rx_us;
+  memcpy(frame.mac,mac,6);
+  frame.len=len;
+  memcpy(frame.data,data,len);
+  rx_head.store(head+1,std::memory_order_release);
+  rx_received++;
+  if(depth+1>rx_max_depth) rx_max_depth=depth+1;
+  if(dispatcher_handle!=nullptr) xTaskNotifyGive(dispatcher_handle);
+}
+
+//分发任务,取出缓冲池中的数据包并调用回调
+static void esp_now_dispatch_task(void* param){
+  while(1){
+    ulTaskNotifyTake(pdTRUE,portMAX_DELAY);
+    uint32_t tail=rx_tail.load(std::memory_order_relaxed);
+    while(tail!=rx_head.load(std::memory_order_acquire)){
+      HXC_ESPNOW_rx_frame_t& frame=rx_pool[tail&(HXC_ESPNOW_RX_POOL_SIZE-1)];
+      HXC_ESPNOW_view view;
+      //密钥可能在入队后被修改,重新解码
+      if(esp_now_decode_view(frame.data,frame.len,view)){
+        view.mac=frame.mac;
+        view.rx_us=frame.rx_us;
+        //检查是否是需要运行回调函数的数据包
+        esp_now_dispatch(view);
+      }
+      //回调返回后才释放,view指向的数据在回调期间有效
+      tail++;
+      rx_tail.store(tail,std::memory_order_release);
+    }
+  }
+}
+
+//设置接收分发任务
+void esp_now_set_dispatcher(UBaseType_t priority,BaseType_t core){
+  dispatcher_priority=priority;
+  dispatcher_core=core;
+}
+
+//获取接收统计
+HXC_ESPNOW_rx_stats_t esp_now_get_rx_stats(){
+  HXC_ESPNOW_rx_stats_t stats;
+  stats.received=rx_received;
+  stats.dropped=rx_dropped;
+  stats.depth=rx_head.load()-rx_tail.load();
+  stats.max_depth=rx_max_depth;
+  return stats;
+}
+
+//发送缓冲池中的一帧
+struct HXC_ESPNOW_tx_frame_t {
+  int64_t queued_us;//放入发送队列的时间
+  uint8_t mac[6];
+  uint8_t len;
+  uint8_t priority;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+};
+
+//令牌桶,令牌以1/1000000帧为单位,只在发送任务中取令牌
+struct HXC_ESPNOW_bucket_t {
+  uint32_t rate;//帧/秒,0为不限速
+  uint32_t burst;
+  int64_t tokens;
+  int64_t last_us;
+};
+
+//单个设备的发送统计
+struct HXC_ESPNOW_peer_tx_t {
+  uint64_t key;//esp_now_mac_key(mac),0为空位
+  uint8_t seq;//发往该设备的下一个序号
+  uint32_t success;
+  uint32_t fail;
+};
+
+static HXC_ESPNOW_tx_frame_t tx_pool[HXC_ESPNOW_TX_POOL_SIZE];//发送缓冲池
+static QueueHandle_t tx_free_queue=nullptr;//空闲帧序号
+static QueueHandle_t tx_ready_queue[HXC_ESPNOW_PRIO_NUM]={nullptr};//各优先级待发送帧序号
+static SemaphoreHandle_t tx_ready_signal=nullptr;//放入待发送队列后唤醒发送任务
+static std::atomic<int> tx_prio_used[HXC_ESPNOW_PRIO_NUM];//各优先级占用的帧数,含正在填写的帧
+static const int tx_prio_limit[HXC_ESPNOW_PRIO_NUM]={HXC_ESPNOW_TX_POOL_SIZE,HXC_ESPNOW_TX_NORMAL_LIMIT,HXC_ESPNOW_TX_LOW_LIMIT};
+static HXC_ESPNOW_bucket_t tx_bucket[HXC_ESPNOW_PRIO_NUM]={{0,1,0,0},{0,1,0,0},{HXC_ESPNOW_LOW_RATE,HXC_ESPNOW_LOW_BURST,0,0}};
+static portMUX_TYPE tx_bucket_lock=portMUX_INITIALIZER_UNLOCKED;
+static HXC_ESPNOW_prio_stats_t tx_prio_stats[HXC_ESPNOW_PRIO_NUM];//排队延时只在发送任务中写入
+static HXC_ESPNOW_peer_tx_t peer_tx_stats[HXC_ESPNOW_PEER_TABLE_SIZE];//各设备发送统计哈希表,只在发送任务中修改
+static int peer_tx_num=0;
+static volatile uint32_t tx_queued=0;
+static volatile uint32_t tx_dropped=0;
+static volatile uint32_t tx_success=0;
+static volatile uint32_t tx_fail=0;
+static volatile bool tx_last_success=false;//最近一次发送完成回调的结果
+static std::function<void(const uint8_t*,bool)> send_callback=nullptr;
+
+//发送任务
+static TaskHandle_t sender_handle=nullptr;
+static UBaseType_t sender_priority=5;
+static BaseType_t sender_core=tskNO_AFFINITY;
+
+/**
+ * @description: 取一个空闲帧,该优先级占用的帧数到上限或没有空闲帧时最多等待wait
+ * @return {int} 帧序号,超时返回-1
+ */
+static int esp_now_tx_acquire(TickType_t wait=0,uint8_t priority=HXC_ESPNOW_PRIO_NORMAL){
+  if(priority>=HXC_ESPNOW_PRIO_NUM) priority=HXC_ESPNOW_PRIO_LOW;
+  uint8_t index;
+  TickType_t start=xTaskGetTickCount();
+  bool reserved=false;
+  while(tx_free_queue!=nullptr){
+    reserved=tx_prio_used[priority].fetch_add(1)<tx_prio_limit[priority];
+    if(reserved) break;
+    tx_prio_used[priority].fetch_sub(1);
+    if(xTaskGetTickCount()-start>=wait) break;
+    vTaskDelay(1);
+  }
+  if(!reserved){
+    tx_dropped++;
+    tx_prio_stats[priority].dropped++;
+    return -1;
+  }
+  TickType_t elapsed=xTaskGetTickCount()-start;
+  if(xQueueReceive(tx_free_queue,&index,wait>elapsed?wait-elapsed:0)!=pdTRUE){
+    tx_prio_used[priority].fetch_sub(1);
+    tx_dropped++;
+    tx_prio_stats[priority].dropped++;
+    return -1;
+  }
+  tx_pool[index].priority=priority;
+  return index;
+}
+
+//帧填好后放入对应优先级的发送队列
+static void esp_now_tx_commit(int index,MAC_t receive_MAC,int len){
+  uint8_t i=index;
+  HXC_ESPNOW_tx_frame_t& frame=tx_pool[i];
+  memcpy(frame.mac,receive_MAC,6);
+  frame.len=len;
+  frame.queued_us=esp_timer_get_time();
+  tx_queued++;
+  tx_prio_stats[frame.priority].queued++;
+  xQueueSend(tx_ready_queue[frame.priority],&i,0);
+  xSemaphoreGive(tx_ready_signal);
+}
+
+//归还帧,发送完成或放弃已取出的空闲帧时调用
+static void esp_now_tx_release(int index){
+  uint8_t i=index;
+  tx_prio_used[tx_pool[i].priority].fetch_sub(1);
+  xQueueSend(tx_free_queue,&i,0);
+}
+
+/**
+ * @description: 从令牌桶取一个令牌
+ * @return {bool} 取到或不限速返回true
+ * @param {int64_t&} wait_us 没有令牌时返回还需等待的时间
+ */
+static bool esp_now_bucket_take(HXC_ESPNOW_bucket_t& bucket,int64_t now,int64_t& wait_us){
+  if(bucket.rate==0) return true;
+  int64_t cap=int64_t(bucket.burst)*1000000;
+  bucket.tokens+=(now-bucket.last_us)*int64_t(bucket.rate);
+  if(bucket.tokens>cap||bucket.last_us==0) bucket.tokens=cap;
+  bucket.last_us=now;
+  if(bucket.tokens>=1000000){
+    bucket.tokens-=1000000;
+    return true;
+  }
+  wait_us=(1000000-bucket.tokens+bucket.rate-1)/bucket.rate;
+  return false;
+}
+
+/**
+ * @description: 按严格优先级取下一帧,限速的优先级没有令牌时跳过
+ * @return {int} 帧序号,没有可发送的帧返回-1
+ * @param {int64_t&} wait_us 返回-1时为最早有令牌的等待时间,没有待发送的帧为-1
+ */
+static int esp_now_tx_next(int64_t now,int64_t& wait_us){
+  wait_us=-1;
+  for(int p=0;p<HXC_ESPNOW_PRIO_NUM;p++){
+    if(uxQueueMessagesWaiting(tx_ready_queue[p])==0) continue;
+    int64_t wait=0;
+    portENTER_CRITICAL(&tx_bucket_lock);
+    bool ok=esp_now_bucket_take(tx_bucket[p],now,wait);
+    portEXIT_CRITICAL(&tx_bucket_lock);
+    if(!ok){
+      if(wait_us<0||wait<wait_us) wait_us=wait;
+      continue;
+    }
+    uint8_t index;
+    if(xQueueReceive(tx_ready_queue[p],&index,0)==pdTRUE) return index;
+  }
+  return -1;
+}
+
+//记录一帧的排队延时
+static void esp_now_tx_latency(HXC_ESPNOW_prio_stats_t& stats,int64_t latency){
+  if(latency<0) latency=0;
+  if(latency>INT32_MAX) latency=INT32_MAX;
+  uint32_t us=latency;
+  stats.sent++;
+  stats.latency_avg_us=stats.sent==1?us:int32_t(stats.latency_avg_us)+(int32_t(us)-int32_t(stats.latency_avg_us))/16;
+  if(us>stats.latency_max_us) stats.latency_max_us=us;
+  int bin=0;
+  while(bin<HXC_ESPNOW_LATENCY_BINS-1&&us>=(uint32_t(125)<<bin)) bin++;
+  stats.latency_hist[bin]++;
+}
+
+//发送完成回调,在WiFi任务中运行,只记录结果并唤醒发送任务
+void OnESPNOWDataSent(const uint8_t *mac, esp_now_send_status_t status){
+  tx_last_success=status==ESP_NOW_SEND_SUCCESS;
+  if(sender_handle!=nullptr) xTaskNotifyGive(sender_handle);
+}
+
+//查找发往某个设备的统计,没有时添加,表满返回nullptr
+static HXC_ESPNOW_peer_tx_t* esp_now_tx_peer(const uint8_t* mac){
+  uint64_t key=esp_now_mac_key(mac);
+  uint32_t slot=esp_now_mac_slot(key);
+  while(peer_tx_stats[slot].key!=0){
+    if(peer_tx_stats[slot].key==key) return &peer_tx_stats[slot];
+    slot=(slot+1)&(HXC_ESPNOW_PEER_TABLE_SIZE-1);
+  }
+  if(peer_tx_num>=HXC_ESPNOW_MAX_PEER) return nullptr;
+  HXC_ESPNOW_peer_tx_t& peer=peer_tx_stats[slot];
+  peer.seq=0;
+  peer.success=0;
+  peer.fail=0;
+  peer.key=key;
+  peer_tx_num++;
+  return &peer;
+}
+
+//发送任务,一次只发送一帧,等待发送完成回调后再发下一帧
+static void esp_now_send_task(void* param){
+  while(1){
+    int64_t now=esp_timer_get_time();
+    int64_t wait_us;
+    int next=esp_now_tx_next(now,wait_us);
+    if(next<0){
+      //等待新的帧,或限速的优先级有令牌
+      xSemaphoreTake(tx_ready_signal,wait_us<0?portMAX_DELAY:pdMS_TO_TICKS(wait_us/1000)+1);
+      continue;
+    }
+    uint8_t index=next;
+    HXC_ESPNOW_tx_frame_t& frame=tx_pool[index];
+    esp_now_tx_latency(tx_prio_stats[frame.priority],now-frame.queued_us);
+    HXC_ESPNOW_peer_tx_t* peer=esp_now_tx_peer(frame.mac);
+    //v2数据包在实际发送前按接收方编号,接收方据此统计丢包
+    if(frame.len>=HXC_ESPNOW_HEADER_LEN&&frame.data[2]==HXC_ESPNOW_V2_MAGIC&&frame.len==HXC_ESPNOW_HEADER_LEN+frame.data[7]){
+      frame.data[6]=peer!=nullptr?peer->seq++:0;
+      if(memcmp(frame.mac,broadcastMacAddress.mac,6)==0) frame.data[3]|=HXC_ESPNOW_FLAG_BROADCAST;
+    }
+    //清除上一帧超时后才到达的通知
+    ulTaskNotifyTake(pdTRUE,0);
+    esp_err_t err=ESP_FAIL;
+    for(int i=0;i<MAX_RETRY;i++){
+      err=esp_now_send(frame.mac,frame.data,frame.len);
+      if(err==ESP_OK) break;
+      //WiFi内部缓冲区满,稍后重试
+      vTaskDelay(1);
+    }
+    bool success=false;
+    if(err==ESP_OK){
+      success=ulTaskNotifyTake(pdTRUE,pdMS_TO_TICKS(HXC_ESPNOW_TX_TIMEOUT_MS))>0&&tx_last_success;
+    }
+    success?tx_success++:tx_fail++;
+    if(peer!=nullptr) success?peer->success++:peer->fail++;
+    if(send_callback){
+      send_callback(frame.mac,success);
+    }
+    esp_now_tx_release(index);
+  }
+}
+
+//设置发送任务
+void esp_now_set_sender(UBaseType_t priority,BaseType_t core){
+  sender_priority=priority;
+  sender_core=core;
+}
+
+//设置发送完成回调
+void esp_now_set_send_callback(std::function<void(const uint8_t*,bool)> func){
+  send_callback=func;
 }
 
 //配对信息对象
@@ -201,6 +1182,84 @@ static esp_now_peer_info_t peerInfo;
 //是否初始化的标志
 static bool is_setup=false;
 
+//esp_now_send_package的发送格式版本,默认旧版,保证未升级的接收端能解析
+static uint8_t send_version=1;
+
+//发送端计数器的锁,如分片消息号
+static portMUX_TYPE send_seq_lock=portMUX_INITIALIZER_UNLOCKED;
+
+//ping主题,数据为 类型(1,0请求1回复) | 随机数(4) | 请求发送时间(8)
+#define HXC_ESPNOW_PING_TOPIC ESPNOW_TOPIC_ID("HXC_ping")
+static uint32_t ping_nonce=0;//本机的ping随机数,用于识别发给自己的回复
+
+//ping主题回调,在分发任务中运行
+static void esp_now_ping_callback(const HXC_ESPNOW_view& view){
+  if(view.data_len!=13) return;
+  if(view.data[0]==0){
+    //原样回复,用广播发送,不需要与对方配对
+    uint8_t reply[13];
+    memcpy(reply,view.data,13);
+    reply[0]=1;
+    esp_now_send_topic(HXC_ESPNOW_PING_TOPIC,reply,13,broadcastMacAddress,0,HXC_ESPNOW_PRIO_CONTROL);
+    return;
+  }
+  uint32_t nonce;
+  int64_t send_us;
+  memcpy(&nonce,view.data+1,4);
+  memcpy(&send_us,view.data+5,8);
+  if(nonce!=ping_nonce) return;
+  HXC_ESPNOW_link_t* link=esp_now_link_find(view.mac);
+  if(link==nullptr) return;
+  int32_t rtt=int32_t(esp_timer_get_time()-send_us);
+  int32_t avg=link->rtt_avg_us.load(std::memory_order_relaxed);
+  link->rtt_us.store(rtt,std::memory_order_relaxed);
+  link->rtt_avg_us.store(avg==0?rtt:avg+(rtt-avg)/8,std::memory_order_relaxed);
+}
+
+//发送ping
+esp_err_t esp_now_ping(MAC_t mac){
+  uint8_t request[13];
+  int64_t now=esp_timer_get_time();
+  request[0]=0;
+  memcpy(request+1,&ping_nonce,4);
+  memcpy(request+5,&now,8);
+  return esp_now_send_topic(HXC_ESPNOW_PING_TOPIC,request,13,mac,0,HXC_ESPNOW_PRIO_CONTROL);
+}
+
+//配对MAC加入集合,已存在或集合已满时不变
+static void esp_now_peer_insert(const uint8_t* mac){
+  uint64_t key=esp_now_mac_key(mac);
+  portENTER_CRITICAL(&peer_mac_lock);
+  uint32_t slot=esp_now_mac_slot(key);
+  while(peer_mac_table[slot]!=0&&peer_mac_table[slot]!=key) slot=(slot+1)&(HXC_ESPNOW_PEER_TABLE_SIZE-1);
+  if(peer_mac_table[slot]==0&&peer_mac_num<HXC_ESPNOW_MAX_PEER){
+    peer_mac_table[slot]=key;
+    peer_mac_num++;
+  }
+  portEXIT_CRITICAL(&peer_mac_lock);
+}
+
+//从集合中删除配对MAC,后移补位保证后面的项仍能找到
+static void esp_now_peer_erase(const uint8_t* mac){
+  const uint32_t mask=HXC_ESPNOW_PEER_TABLE_SIZE-1;
+  uint64_t key=esp_now_mac_key(mac);
+  portENTER_CRITICAL(&peer_mac_lock);
+  uint32_t hole=esp_now_mac_slot(key);
+  while(peer_mac_table[hole]!=0&&peer_mac_table[hole]!=key) hole=(hole+1)&mask;
+  if(peer_mac_table[hole]!=0){
+    for(uint32_t next=(hole+1)&mask;peer_mac_table[next]!=0;next=(next+1)&mask){
+      uint32_t home=esp_now_mac_slot(peer_mac_table[next]);
+      if(((next-home)&mask)>=((next-hole)&mask)){
+        peer_mac_table[hole]=peer_mac_table[next];
+        hole=next;
+      }
+    }
+    peer_mac_table[hole]=0;
+    peer_mac_num--;
+  }
+  portEXIT_CRITICAL(&peer_mac_lock);
+}
+
 //ESP-NOW初始化
 void esp_now_setup(MAC_t receive_MAC,int wifi_channel){
   
@@ -220,56 +1279,137 @@ void esp_now_setup(MAC_t receive_MAC,int wifi_channel){
   }
   peerInfo.ifidx = WIFI_IF_STA;
   memcpy(peerInfo.peer_addr, receive_MAC, 6);
-  peer_mac_list.push_back(receive_MAC);
+  esp_now_peer_insert(receive_MAC.mac);
   esp_now_add_peer(&peerInfo);
 
   if(receive_MAC!=broadcastMacAddress){
     memcpy(peerInfo.peer_addr, broadcastMacAddress, 6);
     esp_now_add_peer(&peerInfo);
   }
+  ping_nonce=esp_random();
+  add_esp_now_topic_callback(HXC_ESPNOW_PING_TOPIC,esp_now_ping_callback);
+  xTaskCreatePinnedToCore(esp_now_dispatch_task,"esp_now_dispatch",4096,nullptr,dispatcher_priority,&dispatcher_handle,dispatcher_core);
   esp_now_register_recv_cb(OnESPNOWDataRecv);
+
+  //发送缓冲池,所有帧初始为空闲
+  tx_free_queue=xQueueCreate(HXC_ESPNOW_TX_POOL_SIZE,sizeof(uint8_t));
+  for(int p=0;p<HXC_ESPNOW_PRIO_NUM;p++){
+    tx_ready_queue[p]=xQueueCreate(HXC_ESPNOW_TX_POOL_SIZE,sizeof(uint8_t));
+  }
+  tx_ready_signal=xSemaphoreCreateBinary();
+  for(uint8_t i=0;i<HXC_ESPNOW_TX_POOL_SIZE;i++){
+    xQueueSend(tx_free_queue,&i,0);
+  }
+  xTaskCreatePinnedToCore(esp_now_send_task,"esp_now_send",2048,nullptr,sender_priority,&sender_handle,sender_core);
+  esp_now_register_send_cb(OnESPNOWDataSent);
 } 
 
 //添加配对MAC
 void add_esp_now_peer_mac(MAC_t mac){
   memcpy(peerInfo.peer_addr, mac, 6);
-  peer_mac_list.push_back(mac);
+  esp_now_peer_insert(mac.mac);
   esp_now_add_peer(&peerInfo);
 };
 
 //删除配对MAC
 void remove_esp_now_peer_mac(MAC_t mac){
-  peer_mac_list.remove(mac);
+  esp_now_peer_erase(mac.mac);
   esp_now_del_peer(mac);
 };
 
 //检查是否是配对MAC
 bool is_esp_now_peer(MAC_t mac){
+  uint64_t key=esp_now_mac_key(mac.mac);
+  bool found=false;
+  portENTER_CRITICAL(&peer_mac_lock);
+  for(uint32_t slot=esp_now_mac_slot(key);peer_mac_table[slot]!=0;slot=(slot+1)&(HXC_ESPNOW_PEER_TABLE_SIZE-1)){
+    if(peer_mac_table[slot]==key){
+      found=true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&peer_mac_lock);
+  return found;
+}
 
-  //检查是否是配对MAC
-  auto item=std::find(peer_mac_list.begin(),peer_mac_list.end(),mac);
+//获取总发送统计
+HXC_ESPNOW_tx_stats_t esp_now_get_tx_stats(){
+  HXC_ESPNOW_tx_stats_t stats;
+  stats.queued=tx_queued;
+  stats.dropped=tx_dropped;
+  stats.depth=0;
+  for(int p=0;p<HXC_ESPNOW_PRIO_NUM;p++){
+    if(tx_ready_queue[p]!=nullptr) stats.depth+=uxQueueMessagesWaiting(tx_ready_queue[p]);
+  }
+  stats.success=tx_success;
+  stats.fail=tx_fail;
+  return stats;
+}
 
-  //没有找到
-  if(item==peer_mac_list.end()) return false;
+//获取发往指定设备的发送统计
+HXC_ESPNOW_tx_stats_t esp_now_get_tx_stats(MAC_t mac){
+  HXC_ESPNOW_tx_stats_t stats={0,0,0,0,0};
+  uint64_t key=esp_now_mac_key(mac.mac);
+  for(uint32_t slot=esp_now_mac_slot(key);peer_tx_stats[slot].key!=0;slot=(slot+1)&(HXC_ESPNOW_PEER_TABLE_SIZE-1)){
+    if(peer_tx_stats[slot].key==key){
+      stats.success=peer_tx_stats[slot].success;
+      stats.fail=peer_tx_stats[slot].fail;
+      break;
+    }
+  }
+  return stats;
+}
 
-  //找到了
-  return true;
+//获取某个优先级的发送统计
+HXC_ESPNOW_prio_stats_t esp_now_get_priority_stats(uint8_t priority){
+  if(priority>=HXC_ESPNOW_PRIO_NUM) priority=HXC_ESPNOW_PRIO_LOW;
+  HXC_ESPNOW_prio_stats_t stats=tx_prio_stats[priority];
+  stats.depth=tx_ready_queue[priority]?uxQueueMessagesWaiting(tx_ready_queue[priority]):0;
+  return stats;
+}
+
+//清零各优先级的发送统计
+void esp_now_reset_priority_stats(){
+  memset(tx_prio_stats,0,sizeof(tx_prio_stats));
+}
+
+//设置某个优先级的令牌桶限速
+void esp_now_set_priority_rate(uint8_t priority,uint32_t rate,uint32_t burst){
+  if(priority>=HXC_ESPNOW_PRIO_NUM) return;
+  portENTER_CRITICAL(&tx_bucket_lock);
+  tx_bucket[priority].rate=rate;
+  tx_bucket[priority].burst=burst>0?burst:1;
+  tx_bucket[priority].last_us=0;
+  portEXIT_CRITICAL(&tx_bucket_lock);
+}
+
+//按主题ID发送v2数据包
+esp_err_t esp_now_send_topic(uint16_t topic_id,const uint8_t* data,int datalen,MAC_t receive_MAC,uint8_t flags,uint8_t priority){
+  if(datalen<0||datalen>HXC_ESPNOW_MAX_PAYLOAD) return ESP_ERR_INVALID_SIZE;
+  int index=esp_now_tx_acquire(0,priority);
+  if(index<0) return ESP_ERR_NO_MEM;
+  //序号由发送任务按接收方填写
+  int len=esp_now_encode(tx_pool[index].data,topic_id,data,datalen,0,flags);
+  esp_now_tx_commit(index,receive_MAC,len);
+  return ESP_OK;
 }
 
 //通过espnow发送数据包
-esp_err_t esp_now_send_package(String name,uint8_t* data,int datalen,MAC_t receive_MAC){
+esp_err_t esp_now_send_package(String name,uint8_t* data,int datalen,MAC_t receive_MAC,uint8_t priority){
+  if(send_version==2){
+    return esp_now_send_topic(esp_now_topic_id(name.c_str(),name.length()),data,datalen,receive_MAC,0,priority);
+  }
+  //旧版格式
+  if(datalen<0||4+int(name.length())+datalen>ESP_NOW_MAX_DATA_LEN) return ESP_ERR_INVALID_SIZE;
+  int index=esp_now_tx_acquire(0,priority);
+  if(index<0) return ESP_ERR_NO_MEM;
   HXC_ESPNOW_data_pakage send_data;
   send_data.add_name(name);
   send_data.add_data(data,datalen);
-  uint8_t send_data_array[send_data.get_len()];
-  send_data.get_data(send_data_array);
-  //发送
-  for(int i=0;i<MAX_RETRY;i++){
-    auto err = esp_now_send(receive_MAC,send_data_array,send_data.get_len());
-    if (err == ESP_OK)  return ESP_OK;
-    delay(20);
-  }
-  return ESP_FAIL;
+  send_data.get_data(tx_pool[index].data);
+  //放入发送队列
+  esp_now_tx_commit(index,receive_MAC,send_data.get_len());
+  return ESP_OK;
 }
 
 //修改数据包密钥
@@ -277,6 +1417,11 @@ void change_secret_key(uint16_t _secret_key){
   secret_key=_secret_key;
 }
 
+//设置发送格式
+void esp_now_set_send_version(uint8_t version){
+  send_version=version==1?1:2;
+}
+
 #endif
 /*
                                               .=%@#=.                                               
@@ -0,0 +1,203 @@
+/*
+ * @Description: ESP-NOW分片传输,超过单包长度的消息拆成多个分片发送,接收端重组后整条交给主题回调
+ * @Author: qingmeijiupiao
+ */
+#ifndef ESPNOWFragment_hpp
+#define ESPNOWFragment_hpp
+#include "ESPNOW.hpp"
+#include "esp_timer.h"
+
+//分片子包头: 消息号(1) | 分片序号(1) | 分片总数(1),位于v2包头之后
+#define HXC_ESPNOW_FRAG_HEADER_LEN 3
+
+//单个分片的数据长度,除最后一个分片外都必须是该长度
+#define HXC_ESPNOW_FRAG_PAYLOAD (HXC_ESPNOW_MAX_PAYLOAD-HXC_ESPNOW_FRAG_HEADER_LEN)
+
+//单条消息最大长度,决定每个重组缓冲区的大小
+#ifndef HXC_ESPNOW_FRAG_MAX_SIZE
+#define HXC_ESPNOW_FRAG_MAX_SIZE 4096
+#endif
+
+//同时重组的消息数,每个占用HXC_ESPNOW_FRAG_MAX_SIZE字节静态内存
+#ifndef HXC_ESPNOW_FRAG_SLOTS
+#define HXC_ESPNOW_FRAG_SLOTS 2
+#endif
+
+//超过该时间没有收到新分片的消息被丢弃,单位ms
+#ifndef HXC_ESPNOW_FRAG_TIMEOUT_MS
+#define HXC_ESPNOW_FRAG_TIMEOUT_MS 200
+#endif
+
+//单条消息最大分片数
+#define HXC_ESPNOW_FRAG_MAX_COUNT ((HXC_ESPNOW_FRAG_MAX_SIZE+HXC_ESPNOW_FRAG_PAYLOAD-1)/HXC_ESPNOW_FRAG_PAYLOAD)
+static_assert(HXC_ESPNOW_FRAG_MAX_COUNT<=255,"HXC_ESPNOW_FRAG_MAX_SIZE too large");
+
+//重组缓冲区
+struct HXC_ESPNOW_frag_slot_t {
+  bool used;
+  uint8_t mac[6];//发送方MAC
+  uint16_t topic_id;
+  uint8_t msg_id;
+  uint8_t count;//分片总数
+  uint8_t received_num;//已收到的分片数
+  uint8_t last_len;//最后一个分片的长度
+  int64_t last_us;//最近收到分片的时间
+  uint32_t received_mask[(HXC_ESPNOW_FRAG_MAX_COUNT+31)/32];
+  uint8_t data[HXC_ESPNOW_FRAG_MAX_SIZE];
+};
+
+//分片统计
+struct HXC_ESPNOW_frag_stats_t {
+  uint32_t sent;//分片发送的消息数
+  uint32_t completed;//重组完成的消息数
+  uint32_t timeout;//超时或被新消息挤掉而丢弃的消息数
+  uint32_t invalid;//格式错误的分片数
+};
+
+static HXC_ESPNOW_frag_slot_t frag_slots[HXC_ESPNOW_FRAG_SLOTS];//重组缓冲区,只在分发任务中访问
+static uint8_t frag_msg_id=0;
+static volatile uint32_t frag_sent=0;
+static volatile uint32_t frag_completed=0;
+static volatile uint32_t frag_timeout=0;
+static volatile uint32_t frag_invalid=0;
+
+//查找消息所在的重组缓冲区,没有时分配一个,顺便回收超时的缓冲区
+static HXC_ESPNOW_frag_slot_t* esp_now_fragment_slot(const HXC_ESPNOW_view& view,uint8_t msg_id,int64_t now){
+  HXC_ESPNOW_frag_slot_t* empty=nullptr;
+  HXC_ESPNOW_frag_slot_t* oldest=nullptr;
+  for(int i=0;i<HXC_ESPNOW_FRAG_SLOTS;i++){
+    HXC_ESPNOW_frag_slot_t& slot=frag_slots[i];
+    if(slot.used&&now-slot.last_us>HXC_ESPNOW_FRAG_TIMEOUT_MS*1000){
+      slot.used=false;
+      frag_timeout++;
+    }
+    if(!slot.used){
+      if(empty==nullptr) empty=&slot;
+      continue;
+    }
+    if(slot.msg_id==msg_id&&slot.topic_id==view.topic_id&&memcmp(slot.mac,view.mac,6)==0) return &slot;
+    if(oldest==nullptr||slot.last_us<oldest->last_us) oldest=&slot;
+  }
+  //缓冲区都在使用,丢弃最久没有收到分片的消息
+  if(empty==nullptr){
+    empty=oldest;
+    frag_timeout++;
+  }
+  empty->used=true;
+  memcpy(empty->mac,view.mac,6);
+  empty->topic_id=view.topic_id;
+  empty->msg_id=msg_id;
+  empty->count=0;
+  empty->received_num=0;
+  empty->last_len=0;
+  memset(empty->received_mask,0,sizeof(empty->received_mask));
+  return empty;
+}
+
+//接收一个分片,在分发任务中运行,消息完整后去掉分片标志再分发
+static void esp_now_fragment_receive(const HXC_ESPNOW_view& view){
+  if(view.data_len<=HXC_ESPNOW_FRAG_HEADER_LEN){
+    frag_invalid++;
+    return;
+  }
+  uint8_t msg_id=view.data[0];
+  uint8_t index=view.data[1];
+  uint8_t count=view.data[2];
+  int len=view.data_len-HXC_ESPNOW_FRAG_HEADER_LEN;
+  if(count==0||count>HXC_ESPNOW_FRAG_MAX_COUNT||index>=count||(index+1<count&&len!=HXC_ESPNOW_FRAG_PAYLOAD)){
+    frag_invalid++;
+    return;
+  }
+  //最后一个分片可能超出缓冲区末尾(发送端的HXC_ESPNOW_FRAG_MAX_SIZE更大或数据被篡改)
+  if(index*HXC_ESPNOW_FRAG_PAYLOAD+len>HXC_ESPNOW_FRAG_MAX_SIZE){
+    frag_invalid++;
+    return;
+  }
+  HXC_ESPNOW_view message=view;
+  message.flags&=~HXC_ESPNOW_FLAG_FRAGMENT;
+  //只有一个分片时不需要重组
+  if(count==1){
+    message.data=view.data+HXC_ESPNOW_FRAG_HEADER_LEN;
+    message.data_len=len;
+    frag_completed++;
+    esp_now_dispatch(message);
+    return;
+  }
+  int64_t now=esp_timer_get_time();
+  HXC_ESPNOW_frag_slot_t* slot=esp_now_fragment_slot(view,msg_id,now);
+  if(slot->count==0){
+    slot->count=count;
+  }else if(slot->count!=count){
+    frag_invalid++;
+    return;
+  }
+  slot->last_us=now;
+  uint32_t bit=1u<<(index&31);
+  //重复的分片
+  if(slot->received_mask[index>>5]&bit) return;
+  slot->received_mask[index>>5]|=bit;
+  memcpy(slot->data+index*HXC_ESPNOW_FRAG_PAYLOAD,view.data+HXC_ESPNOW_FRAG_HEADER_LEN,len);
+  if(index+1==count) slot->last_len=len;
+  if(++slot->received_num<count) return;
+  message.mac=slot->mac;
+  message.data=slot->data;
+  message.data_len=(count-1)*HXC_ESPNOW_FRAG_PAYLOAD+slot->last_len;
+  frag_completed++;
+  esp_now_dispatch(message);
+  //回调返回后才释放,数据在回调期间有效
+  slot->used=false;
+}
+
+//包含本头文件即启用分片接收
+static struct HXC_ESPNOW_fragment_init_t {
+  HXC_ESPNOW_fragment_init_t(){
+    esp_now_set_flag_handler(HXC_ESPNOW_FLAG_FRAGMENT,esp_now_fragment_receive);
+  }
+} fragment_init;
+
+/**
+ * @description: 发送任意长度的消息,不超过单包长度时与esp_now_send_topic相同,否则拆成分片发送
+ * @return {esp_err_t} 全部分片放入发送队列返回ESP_OK,数据过长返回ESP_ERR_INVALID_SIZE,
+ *                     等待空闲帧超时返回ESP_ERR_NO_MEM,此时已放入的分片在接收端超时后丢弃
+ * @param {uint16_t} topic_id 主题ID
+ * @param {const uint8_t*} data 数据
+ * @param {int} datalen 数据长度,不超过HXC_ESPNOW_FRAG_MAX_SIZE
+ * @param {MAC_t} receive_MAC 接收数据的设备MAC 默认广播地址
+ * @param {TickType_t} wait 每个分片等待空闲发送帧的最长时间,分片数超过发送缓冲池时需要等待前面的分片发出
+ * @param {uint8_t} priority 发送优先级,大块数据默认低优先级,受令牌桶限速
+ */
+esp_err_t esp_now_send_large(uint16_t topic_id,const uint8_t* data,int datalen,MAC_t receive_MAC=broadcastMacAddress,TickType_t wait=pdMS_TO_TICKS(100),uint8_t priority=HXC_ESPNOW_PRIO_LOW){
+  if(datalen<0||datalen>HXC_ESPNOW_FRAG_MAX_SIZE) return ESP_ERR_INVALID_SIZE;
+  if(datalen<=HXC_ESPNOW_MAX_PAYLOAD) return esp_now_send_topic(topic_id,data,datalen,receive_MAC,0,priority);
+  int count=(datalen+HXC_ESPNOW_FRAG_PAYLOAD-1)/HXC_ESPNOW_FRAG_PAYLOAD;
+  portENTER_CRITICAL(&send_seq_lock);
+  uint8_t msg_id=frag_msg_id++;
+  portEXIT_CRITICAL(&send_seq_lock);
+  uint8_t payload[HXC_ESPNOW_MAX_PAYLOAD];
+  for(int i=0;i<count;i++){
+    int len=datalen-i*HXC_ESPNOW_FRAG_PAYLOAD;
+    if(len>HXC_ESPNOW_FRAG_PAYLOAD) len=HXC_ESPNOW_FRAG_PAYLOAD;
+    payload[0]=msg_id;
+    payload[1]=i;
+    payload[2]=count;
+    memcpy(payload+HXC_ESPNOW_FRAG_HEADER_LEN,data+i*HXC_ESPNOW_FRAG_PAYLOAD,len);
+    int index=esp_now_tx_acquire(wait,priority);
+    if(index<0) return ESP_ERR_NO_MEM;
+    int frame_len=esp_now_encode(tx_pool[index].data,topic_id,payload,HXC_ESPNOW_FRAG_HEADER_LEN+len,0,HXC_ESPNOW_FLAG_FRAGMENT);
+    esp_now_tx_commit(index,receive_MAC,frame_len);
+  }
+  frag_sent++;
+  return ESP_OK;
+}
+
+//获取分片统计
+HXC_ESPNOW_frag_stats_t esp_now_get_fragment_stats(){
+  HXC_ESPNOW_frag_stats_t stats;
+  stats.sent=frag_sent;
+  stats.completed=frag_completed;
+  stats.timeout=frag_timeout;
+  stats.invalid=frag_invalid;
+  return stats;
+}
+
+#endif
@@ -0,0 +1,416 @@
+/*
+ * @Description: ESP-NOW可靠传输,序号+应答位图+按RTT自适应的重传超时,接收端去重,
+ *               只有用esp_now_send_reliable发送的数据包有额外开销
+ * @Author: qingmeijiupiao
+ */
+#ifndef ESPNOWReliable_hpp
+#define ESPNOWReliable_hpp
+#include "ESPNOW.hpp"
+#include "esp_timer.h"
+
+//可靠传输子包头: 会话号(4) | 序号(2),位于v2包头之后
+#define HXC_ESPNOW_REL_HEADER_LEN 6
+
+//可靠传输单个数据包最大数据长度
+#define HXC_ESPNOW_REL_PAYLOAD (HXC_ESPNOW_MAX_PAYLOAD-HXC_ESPNOW_REL_HEADER_LEN)
+
+//应答数据: 会话号(4) | 接收端最小未收序号(2) | 已收位图(4),第i位表示该序号+i已收到
+#define HXC_ESPNOW_REL_ACK_LEN 10
+
+//可靠通道数,每个(设备,主题)一个通道,发送端和接收端各有一张表
+#ifndef HXC_ESPNOW_REL_CHANNELS
+#define HXC_ESPNOW_REL_CHANNELS 4
+#endif
+
+//每个通道未确认的数据包数,不超过32,窗口满时发送返回ESP_ERR_NO_MEM
+#ifndef HXC_ESPNOW_REL_WINDOW
+#define HXC_ESPNOW_REL_WINDOW 8
+#endif
+
+//最大重传次数,超过后认为发送失败
+#ifndef HXC_ESPNOW_REL_MAX_RETRY
+#define HXC_ESPNOW_REL_MAX_RETRY 10
+#endif
+
+//重传超时的初值和上下限,单位us
+#define HXC_ESPNOW_REL_INIT_RTO_US 20000
+#define HXC_ESPNOW_REL_MIN_RTO_US 3000
+#define HXC_ESPNOW_REL_MAX_RTO_US 200000
+
+//重传检查周期,单位ms
+#define HXC_ESPNOW_REL_TICK_MS 1
+
+static_assert(HXC_ESPNOW_REL_WINDOW<=32,"HXC_ESPNOW_REL_WINDOW must not exceed 32");
+
+//等待确认的数据包
+struct HXC_ESPNOW_rel_msg_t {
+  bool used;
+  uint8_t retries;//已重传次数
+  uint8_t len;//含子包头的长度
+  uint16_t seq;
+  int64_t send_us;//第一次发送的时间
+  int64_t deadline_us;//下次重传的时间
+  uint8_t data[HXC_ESPNOW_MAX_PAYLOAD];//含子包头
+};
+
+//发送端通道
+struct HXC_ESPNOW_rel_tx_t {
+  bool used;
+  uint8_t mac[6];
+  uint16_t topic_id;
+  uint32_t session;//会话号,通道建立时随机生成且不为0,接收端据此识别发送端重启或通道重建
+  uint16_t next_seq;
+  int32_t srtt_us;//平滑RTT,0表示还没有样本
+  int32_t rttvar_us;//RTT偏差
+  int32_t rto_us;//重传超时
+  int64_t last_us;//最近使用的时间
+  HXC_ESPNOW_rel_msg_t window[HXC_ESPNOW_REL_WINDOW];
+};
+
+//接收端通道
+struct HXC_ESPNOW_rel_rx_t {
+  bool used;
+  uint8_t mac[6];
+  uint16_t topic_id;
+  uint32_t session;
+  uint16_t base;//最小的未收到序号
+  uint32_t mask;//第i位表示base+i已收到,第0位总是0
+  int64_t last_us;
+};
+
+//可靠传输统计
+struct HXC_ESPNOW_reliable_stats_t {
+  uint32_t sent;//发送的数据包数
+  uint32_t retransmit;//重传次数
+  uint32_t acked;//收到确认的数据包数
+  uint32_t failed;//超过最大重传次数的数据包数
+  uint32_t duplicate;//接收端丢弃的重复数据包数
+  int32_t srtt_us;//平滑RTT,只有按通道查询时有效
+  int32_t rto_us;//当前重传超时,只有按通道查询时有效
+};
+
+static HXC_ESPNOW_rel_tx_t rel_tx[HXC_ESPNOW_REL_CHANNELS];//发送端通道,用rel_lock保护
+static HXC_ESPNOW_rel_rx_t rel_rx[HXC_ESPNOW_REL_CHANNELS];//接收端通道,只在分发任务中访问
+static portMUX_TYPE rel_lock=portMUX_INITIALIZER_UNLOCKED;
+static uint32_t rel_last_session=0;//最近生成的会话号,用rel_lock保护
+static esp_timer_handle_t rel_timer=nullptr;
+static std::function<void(uint16_t,uint16_t,bool)> reliable_callback=nullptr;
+static volatile uint32_t rel_sent=0;
+static volatile uint32_t rel_retransmit=0;
+static volatile uint32_t rel_acked=0;
+static volatile uint32_t rel_failed=0;
+static volatile uint32_t rel_duplicate=0;
+
+//按RTT样本更新重传超时,RTO=SRTT+4*RTTVAR
+static void esp_now_reliable_rtt(HXC_ESPNOW_rel_tx_t& channel,int32_t rtt_us){
+  if(channel.srtt_us==0){
+    channel.srtt_us=rtt_us>0?rtt_us:1;
+    channel.rttvar_us=rtt_us/2;
+  }else{
+    int32_t error=channel.srtt_us-rtt_us;
+    if(error<0) error=-error;
+    channel.rttvar_us+=(error-channel.rttvar_us)/4;
+    channel.srtt_us+=(rtt_us-channel.srtt_us)/8;
+  }
+  int32_t rto=channel.srtt_us+4*channel.rttvar_us;
+  if(rto<HXC_ESPNOW_REL_MIN_RTO_US) rto=HXC_ESPNOW_REL_MIN_RTO_US;
+  if(rto>HXC_ESPNOW_REL_MAX_RTO_US) rto=HXC_ESPNOW_REL_MAX_RTO_US;
+  channel.rto_us=rto;
+}
+
+//查找发送端通道,没有时建立,只能在rel_lock内调用
+static HXC_ESPNOW_rel_tx_t* esp_now_reliable_tx_channel(const uint8_t* mac,uint16_t topic_id){
+  HXC_ESPNOW_rel_tx_t* empty=nullptr;
+  HXC_ESPNOW_rel_tx_t* idle=nullptr;
+  for(int i=0;i<HXC_ESPNOW_REL_CHANNELS;i++){
+    HXC_ESPNOW_rel_tx_t& channel=rel_tx[i];
+    if(!channel.used){
+      if(empty==nullptr) empty=&channel;
+      continue;
+    }
+    if(channel.topic_id==topic_id&&memcmp(channel.mac,mac,6)==0) return &channel;
+    //没有未确认数据包的通道可以被替换
+    bool busy=false;
+    for(int j=0;j<HXC_ESPNOW_REL_WINDOW;j++){
+      if(channel.window[j].used){
+        busy=true;
+        break;
+      }
+    }
+    if(!busy&&(idle==nullptr||channel.last_us<idle->last_us)) idle=&channel;
+  }
+  if(empty==nullptr) empty=idle;
+  if(empty==nullptr) return nullptr;
+  memset(empty,0,sizeof(HXC_ESPNOW_rel_tx_t));
+  empty->used=true;
+  memcpy(empty->mac,mac,6);
+  empty->topic_id=topic_id;
+  //32位随机会话号,会话号相同时接收端会把新会话的序号当成重复,32位时这种情况可以忽略
+  uint32_t session;
+  do{
+    session=esp_random();
+  }while(session==0||session==rel_last_session);
+  rel_last_session=session;
+  empty->session=session;
+  empty->rto_us=HXC_ESPNOW_REL_INIT_RTO_US;
+  return empty;
+}
+
+//重传检查,在定时器任务中运行,每次在锁内取出一个到期的数据包,在锁外发送
+static void esp_now_reliable_tick(void* arg=nullptr){
+  uint8_t frame[HXC_ESPNOW_MAX_PAYLOAD];
+  while(1){
+    int64_t now=esp_timer_get_time();
+    int len=0;
+    bool failed=false;
+    uint8_t mac[6];
+    uint16_t topic_id=0;
+    uint16_t seq=0;
+    portENTER_CRITICAL(&rel_lock);
+    for(int i=0;i<HXC_ESPNOW_REL_CHANNELS&&len==0&&!failed;i++){
+      HXC_ESPNOW_rel_tx_t& channel=rel_tx[i];
+      if(!channel.used) continue;
+      for(int j=0;j<HXC_ESPNOW_REL_WINDOW;j++){
+        HXC_ESPNOW_rel_msg_t& msg=channel.window[j];
+        if(!msg.used||now<msg.deadline_us) continue;
+        memcpy(mac,channel.mac,6);
+        topic_id=channel.topic_id;
+        seq=msg.seq;
+        if(msg.retries>=HXC_ESPNOW_REL_MAX_RETRY){
+          msg.used=false;
+          failed=true;
+          break;
+        }
+        //指数退避
+        msg.retries++;
+        int64_t rto=int64_t(channel.rto_us)<<msg.retries;
+        msg.deadline_us=now+(rto<HXC_ESPNOW_REL_MAX_RTO_US?rto:HXC_ESPNOW_REL_MAX_RTO_US);
+        len=msg.len;
+        memcpy(frame,msg.data,len);
+        break;
+      }
+    }
+    portEXIT_CRITICAL(&rel_lock);
+    if(failed){
+      rel_failed++;
+      if(reliable_callback) reliable_callback(topic_id,seq,false);
+      continue;
+    }
+    if(len==0) break;
+    rel_retransmit++;
+    esp_now_send_topic(topic_id,frame,len,MAC_t(mac),HXC_ESPNOW_FLAG_RELIABLE,HXC_ESPNOW_PRIO_CONTROL);
+  }
+}
+
+//收到应答,在分发任务中运行
+static void esp_now_reliable_ack(const HXC_ESPNOW_view& view){
+  if(view.data_len!=HXC_ESPNOW_REL_ACK_LEN) return;
+  uint32_t session;
+  memcpy(&session,view.data,4);
+  uint16_t base=uint16_t(view.data[4]|(view.data[5]<<8));
+  uint32_t mask;
+  memcpy(&mask,view.data+6,4);
+  int64_t now=esp_timer_get_time();
+  uint16_t acked[HXC_ESPNOW_REL_WINDOW];
+  int acked_num=0;
+  portENTER_CRITICAL(&rel_lock);
+  for(int i=0;i<HXC_ESPNOW_REL_CHANNELS;i++){
+    HXC_ESPNOW_rel_tx_t& channel=rel_tx[i];
+    if(!channel.used||channel.session!=session||channel.topic_id!=view.topic_id||memcmp(channel.mac,view.mac,6)!=0) continue;
+    for(int j=0;j<HXC_ESPNOW_REL_WINDOW;j++){
+      HXC_ESPNOW_rel_msg_t& msg=channel.window[j];
+      if(!msg.used) continue;
+      int16_t d=int16_t(msg.seq-base);
+      if(d>=0&&(d>=32||!(mask&(1u<<d)))) continue;
+      //只用没有重传过的数据包计算RTT,重传后无法区分应答对应哪一次发送
+      if(msg.retries==0) esp_now_reliable_rtt(channel,int32_t(now-msg.send_us));
+      msg.used=false;
+      acked[acked_num++]=msg.seq;
+    }
+    break;
+  }
+  portEXIT_CRITICAL(&rel_lock);
+  rel_acked+=acked_num;
+  if(reliable_callback){
+    for(int i=0;i<acked_num;i++) reliable_callback(view.topic_id,acked[i],true);
+  }
+}
+
+//查找接收端通道,没有时替换最久没有使用的通道
+static HXC_ESPNOW_rel_rx_t* esp_now_reliable_rx_channel(const HXC_ESPNOW_view& view,bool& created){
+  HXC_ESPNOW_rel_rx_t* oldest=nullptr;
+  created=false;
+  for(int i=0;i<HXC_ESPNOW_REL_CHANNELS;i++){
+    HXC_ESPNOW_rel_rx_t& channel=rel_rx[i];
+    if(channel.used&&channel.topic_id==view.topic_id&&memcmp(channel.mac,view.mac,6)==0) return &channel;
+    if(oldest==nullptr||!channel.used||(oldest->used&&channel.last_us<oldest->last_us)) oldest=&channel;
+  }
+  oldest->used=true;
+  memcpy(oldest->mac,view.mac,6);
+  oldest->topic_id=view.topic_id;
+  created=true;
+  return oldest;
+}
+
+//收到可靠传输数据包,在分发任务中运行,先回应答,不是重复的数据包去掉子包头再分发
+static void esp_now_reliable_receive(const HXC_ESPNOW_view& view){
+  if(view.data_len<HXC_ESPNOW_REL_HEADER_LEN) return;
+  uint32_t session;
+  memcpy(&session,view.data,4);
+  uint16_t seq=uint16_t(view.data[4]|(view.data[5]<<8));
+  int64_t now=esp_timer_get_time();
+  bool created;
+  HXC_ESPNOW_rel_rx_t* channel=esp_now_reliable_rx_channel(view,created);
+  if(created||channel->session!=session){
+    channel->session=session;
+    channel->mask=0;
+    if(created&&seq>=HXC_ESPNOW_REL_WINDOW){
+      //通道被替换后丢失了历史,当前序号之前一个窗口内的序号当作未收到
+      channel->base=seq-HXC_ESPNOW_REL_WINDOW+1;
+    }else{
+      //新会话序号从0开始
+      channel->base=0;
+    }
+  }
+  channel->last_us=now;
+  int16_t d=int16_t(seq-channel->base);
+  bool duplicate=d<0;
+  if(!duplicate){
+    if(d>=32){
+      //超出位图范围,滑动窗口,之前的序号当作已收到
+      int shift=d-31;
+      channel->mask=shift>=32?0:channel->mask>>shift;
+      channel->base+=shift;
+      d=31;
+    }
+    duplicate=channel->mask&(1u<<d);
+    channel->mask|=1u<<d;
+    while(channel->mask&1){
+      channel->mask>>=1;
+      channel->base++;
+    }
+  }
+  //重复的数据包也要应答,可能是上一个应答丢了
+  uint8_t ack[HXC_ESPNOW_REL_ACK_LEN];
+  memcpy(ack,&session,4);
+  ack[4]=channel->base&0xFF;
+  ack[5]=channel->base>>8;
+  memcpy(ack+6,&channel->mask,4);
+  MAC_t sender((uint8_t*)view.mac);
+  if(!is_esp_now_peer(sender)) add_esp_now_peer_mac(sender);
+  esp_now_send_topic(view.topic_id,ack,HXC_ESPNOW_REL_ACK_LEN,sender,HXC_ESPNOW_FLAG_ACK,HXC_ESPNOW_PRIO_CONTROL);
+  if(duplicate){
+    rel_duplicate++;
+    return;
+  }
+  HXC_ESPNOW_view message=view;
+  message.flags&=~HXC_ESPNOW_FLAG_RELIABLE;
+  message.data=view.data+HXC_ESPNOW_REL_HEADER_LEN;
+  message.data_len=view.data_len-HXC_ESPNOW_REL_HEADER_LEN;
+  esp_now_dispatch(message);
+}
+
+//包含本头文件即启用可靠传输的接收和应答处理
+static struct HXC_ESPNOW_reliable_init_t {
+  HXC_ESPNOW_reliable_init_t(){
+    esp_now_set_flag_handler(HXC_ESPNOW_FLAG_RELIABLE,esp_now_reliable_receive);
+    esp_now_set_flag_handler(HXC_ESPNOW_FLAG_ACK,esp_now_reliable_ack);
+  }
+} reliable_init;
+
+/**
+ * @description: 可靠发送,对方收到后应答,超时未应答自动重传,接收端去除重复的数据包
+ * @return {esp_err_t} 放入发送队列返回ESP_OK,广播地址返回ESP_ERR_INVALID_ARG,数据过长返回ESP_ERR_INVALID_SIZE,
+ *                     窗口满,通道用完或发送队列满返回ESP_ERR_NO_MEM
+ * @param {uint16_t} topic_id 主题ID,每个(设备,主题)是一个独立的通道
+ * @param {const uint8_t*} data 数据
+ * @param {int} datalen 数据长度,不超过HXC_ESPNOW_REL_PAYLOAD
+ * @param {MAC_t} receive_MAC 接收数据的设备MAC,必须是单播地址且已配对
+ */
+esp_err_t esp_now_send_reliable(uint16_t topic_id,const uint8_t* data,int datalen,MAC_t receive_MAC){
+  if(receive_MAC==broadcastMacAddress) return ESP_ERR_INVALID_ARG;
+  if(datalen<0||datalen>HXC_ESPNOW_REL_PAYLOAD) return ESP_ERR_INVALID_SIZE;
+  if(rel_timer==nullptr){
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = esp_now_reliable_tick;
+    timer_args.dispatch_method = ESP_TIMER_TASK;
+    timer_args.name = "esp_now_reliable";
+    esp_timer_create(&timer_args, &rel_timer);
+    esp_timer_start_periodic(rel_timer, HXC_ESPNOW_REL_TICK_MS * 1000);
+  }
+  int64_t now=esp_timer_get_time();
+  uint8_t frame[HXC_ESPNOW_MAX_PAYLOAD];
+  portENTER_CRITICAL(&rel_lock);
+  HXC_ESPNOW_rel_tx_t* channel=esp_now_reliable_tx_channel(receive_MAC,topic_id);
+  HXC_ESPNOW_rel_msg_t* msg=nullptr;
+  if(channel!=nullptr){
+    for(int i=0;i<HXC_ESPNOW_REL_WINDOW;i++){
+      HXC_ESPNOW_rel_msg_t& item=channel->window[i];
+      if(!item.used){
+        if(msg==nullptr) msg=&item;
+      }else if(uint16_t(channel->next_seq-item.seq)>=32){
+        //最早未确认的序号必须在应答位图范围内,否则接收端会跳过它
+        msg=nullptr;
+        break;
+      }
+    }
+  }
+  if(msg!=nullptr){
+    msg->used=true;
+    msg->retries=0;
+    msg->seq=channel->next_seq++;
+    msg->send_us=now;
+    msg->deadline_us=now+channel->rto_us;
+    msg->len=HXC_ESPNOW_REL_HEADER_LEN+datalen;
+    memcpy(msg->data,&channel->session,4);
+    msg->data[4]=msg->seq&0xFF;
+    msg->data[5]=msg->seq>>8;
+    memcpy(msg->data+HXC_ESPNOW_REL_HEADER_LEN,data,datalen);
+    memcpy(frame,msg->data,msg->len);
+    channel->last_us=now;
+  }
+  portEXIT_CRITICAL(&rel_lock);
+  if(msg==nullptr) return ESP_ERR_NO_MEM;
+  rel_sent++;
+  //发送队列满时不用退回,按超时重传
+  esp_now_send_topic(topic_id,frame,HXC_ESPNOW_REL_HEADER_LEN+datalen,receive_MAC,HXC_ESPNOW_FLAG_RELIABLE,HXC_ESPNOW_PRIO_CONTROL);
+  return ESP_OK;
+}
+
+/**
+ * @description: 设置可靠发送结果回调
+ * @param func 回调函数,参数为主题ID,序号和是否送达,送达在分发任务中调用,失败在定时器任务中调用
+ */
+void esp_now_set_reliable_callback(std::function<void(uint16_t,uint16_t,bool)> func){
+  reliable_callback=func;
+}
+
+//获取可靠传输总统计
+HXC_ESPNOW_reliable_stats_t esp_now_get_reliable_stats(){
+  HXC_ESPNOW_reliable_stats_t stats;
+  stats.sent=rel_sent;
+  stats.retransmit=rel_retransmit;
+  stats.acked=rel_acked;
+  stats.failed=rel_failed;
+  stats.duplicate=rel_duplicate;
+  stats.srtt_us=0;
+  stats.rto_us=0;
+  return stats;
+}
+
+//获取发往指定设备指定主题的通道的RTT和重传超时,没有该通道时为0
+HXC_ESPNOW_reliable_stats_t esp_now_get_reliable_stats(MAC_t mac,uint16_t topic_id){
+  HXC_ESPNOW_reliable_stats_t stats=esp_now_get_reliable_stats();
+  portENTER_CRITICAL(&rel_lock);
+  for(int i=0;i<HXC_ESPNOW_REL_CHANNELS;i++){
+    if(rel_tx[i].used&&rel_tx[i].topic_id==topic_id&&memcmp(rel_tx[i].mac,mac.mac,6)==0){
+      stats.srtt_us=rel_tx[i].srtt_us;
+      stats.rto_us=rel_tx[i].rto_us;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&rel_lock);
+  return stats;
+}
+
+#endif
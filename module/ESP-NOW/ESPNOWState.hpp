@@ -0,0 +1,419 @@
+/*
+ * @Description: ESP-NOW状态主题,发布只覆盖最新值,定时按每个主题的频率上限把有更新的主题打包成一帧发送,接收端随时读取一致的最新值
+ * @Author: qingmeijiupiao
+ */
+#ifndef ESPNOWState_hpp
+#define ESPNOWState_hpp
+#include "ESPNOW.hpp"
+#include "ESPNOWTyped.hpp"
+#include "esp_timer.h"
+
+//状态帧主题,数据为若干条目,每条 主题ID(2) | 长度(1) | 数据
+#define HXC_ESPNOW_STATE_TOPIC ESPNOW_TOPIC_ID("HXC_state")
+#define HXC_ESPNOW_STATE_ENTRY_HEADER_LEN 3
+
+//发布和订阅的状态主题各自最多的数量
+#ifndef HXC_ESPNOW_STATE_MAX_TOPIC
+#define HXC_ESPNOW_STATE_MAX_TOPIC 16
+#endif
+
+//单个状态值的最大长度
+#ifndef HXC_ESPNOW_STATE_MAX_SIZE
+#define HXC_ESPNOW_STATE_MAX_SIZE 64
+#endif
+static_assert(HXC_ESPNOW_STATE_ENTRY_HEADER_LEN+HXC_ESPNOW_STATE_MAX_SIZE<=HXC_ESPNOW_MAX_PAYLOAD,"HXC_ESPNOW_STATE_MAX_SIZE too large");
+
+//发送调度周期,决定从发布到发出的最大延时,单位ms
+#ifndef HXC_ESPNOW_STATE_TICK_MS
+#define HXC_ESPNOW_STATE_TICK_MS 5
+#endif
+
+//默认每个主题的最高发送频率,单位Hz
+#ifndef HXC_ESPNOW_STATE_RATE_HZ
+#define HXC_ESPNOW_STATE_RATE_HZ 50
+#endif
+
+//发布端的一个状态主题
+struct HXC_ESPNOW_state_tx_t {
+  uint16_t topic_id;
+  uint8_t mac[6];//接收方
+  uint8_t priority;
+  uint8_t len;
+  bool dirty;//有还没发出的新值
+  uint32_t interval_us;//两次发送的最小间隔
+  int64_t next_us;//最早可以再次发送的时间
+  uint8_t data[HXC_ESPNOW_STATE_MAX_SIZE];
+};
+
+//接收端的一个状态主题,分发任务写入,任意任务读取
+struct HXC_ESPNOW_state_rx_t {
+  uint16_t topic_id;
+  std::atomic<uint32_t> version;//顺序锁,奇数表示正在写入
+  uint32_t updates;//收到的更新数
+  uint8_t len;
+  uint8_t mac[6];//发送方
+  int64_t rx_us;//收到最新值的时间
+  uint8_t data[HXC_ESPNOW_STATE_MAX_SIZE];
+  topic_callback_func callback;
+};
+
+//读取状态时附带的信息
+struct HXC_ESPNOW_state_info_t {
+  uint32_t updates;//收到的更新数,两次读取之间不变说明没有新值
+  int64_t age_us;//最新值收到至今的时间
+  uint8_t mac[6];//发送方MAC
+};
+
+//状态主题统计
+struct HXC_ESPNOW_state_stats_t {
+  uint32_t published;//发布调用次数
+  uint32_t coalesced;//发出前被新值覆盖的次数
+  uint32_t entries_sent;//发出的状态条目数
+  uint32_t frames_sent;//发出的状态帧数
+  uint32_t frames_dropped;//没有空闲发送帧推迟到下个周期的次数
+  uint32_t received;//收到并保存的状态条目数
+  uint32_t unknown;//收到未订阅主题或格式错误的条目数
+};
+
+static HXC_ESPNOW_state_tx_t state_tx[HXC_ESPNOW_STATE_MAX_TOPIC];
+static int state_tx_num=0;
+static int state_tx_next=0;//下一帧从这个主题开始打包,轮流优先
+static portMUX_TYPE state_tx_lock=portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t state_timer=nullptr;
+
+static HXC_ESPNOW_state_rx_t state_rx[HXC_ESPNOW_STATE_MAX_TOPIC];
+static std::atomic<int> state_rx_num{0};
+static portMUX_TYPE state_rx_lock=portMUX_INITIALIZER_UNLOCKED;
+
+static volatile uint32_t state_published=0;
+static volatile uint32_t state_coalesced=0;
+static volatile uint32_t state_entries_sent=0;
+static volatile uint32_t state_frames_sent=0;
+static volatile uint32_t state_frames_dropped=0;
+static volatile uint32_t state_received=0;
+static volatile uint32_t state_unknown=0;
+
+//查找发布端主题,需持有state_tx_lock
+static HXC_ESPNOW_state_tx_t* esp_now_state_tx_find(uint16_t topic_id){
+  for(int i=0;i<state_tx_num;i++){
+    if(state_tx[i].topic_id==topic_id) return &state_tx[i];
+  }
+  return nullptr;
+}
+
+//查找接收端主题,主题数少,顺序查找
+static HXC_ESPNOW_state_rx_t* esp_now_state_rx_find(uint16_t topic_id){
+  int num=state_rx_num.load(std::memory_order_acquire);
+  for(int i=0;i<num;i++){
+    if(state_rx[i].topic_id==topic_id) return &state_rx[i];
+  }
+  return nullptr;
+}
+
+//主题是否到了可以发送的时间,需持有state_tx_lock
+static bool esp_now_state_due(const HXC_ESPNOW_state_tx_t& slot,int64_t now){
+  return slot.dirty&&now>=slot.next_us;
+}
+
+/**
+ * @description: 把发往同一设备、同一优先级且到期的主题打包进一帧,需持有state_tx_lock
+ * @return {int} 打包后的数据长度,0表示没有打包任何主题
+ */
+static int esp_now_state_pack(uint8_t* out,const uint8_t* mac,uint8_t priority,int64_t now){
+  int len=0;
+  int packed=0;
+  for(int k=0;k<state_tx_num;k++){
+    int i=(state_tx_next+k)%state_tx_num;
+    HXC_ESPNOW_state_tx_t& slot=state_tx[i];
+    if(!esp_now_state_due(slot,now)||slot.priority!=priority||memcmp(slot.mac,mac,6)!=0) continue;
+    if(len+HXC_ESPNOW_STATE_ENTRY_HEADER_LEN+slot.len>HXC_ESPNOW_MAX_PAYLOAD) continue;
+    out[len]=slot.topic_id&0xFF;
+    out[len+1]=slot.topic_id>>8;
+    out[len+2]=slot.len;
+    memcpy(out+len+HXC_ESPNOW_STATE_ENTRY_HEADER_LEN,slot.data,slot.len);
+    len+=HXC_ESPNOW_STATE_ENTRY_HEADER_LEN+slot.len;
+    slot.dirty=false;
+    //按时发送时保持相位,落后超过一个间隔时从现在重新计时
+    slot.next_us=now-slot.next_us<slot.interval_us?slot.next_us+slot.interval_us:now+slot.interval_us;
+    if(packed++==0) state_tx_next=(i+1)%state_tx_num;
+  }
+  if(packed>0) state_entries_sent+=packed;
+  return len;
+}
+
+//发送调度,在esp_timer任务中运行,每次循环发出一帧,直到没有到期的主题或没有空闲发送帧
+static void esp_now_state_tick(void* arg){
+  int64_t now=esp_timer_get_time();
+  for(int n=0;n<HXC_ESPNOW_STATE_MAX_TOPIC;n++){
+    //先找一个到期的主题确定这一帧的接收方和优先级,取空闲帧要在临界区外
+    MAC_t mac;
+    uint8_t priority=HXC_ESPNOW_PRIO_NORMAL;
+    bool found=false;
+    portENTER_CRITICAL(&state_tx_lock);
+    for(int k=0;k<state_tx_num&&!found;k++){
+      HXC_ESPNOW_state_tx_t& slot=state_tx[(state_tx_next+k)%state_tx_num];
+      if(!esp_now_state_due(slot,now)) continue;
+      memcpy(mac.mac,slot.mac,6);
+      priority=slot.priority;
+      found=true;
+    }
+    portEXIT_CRITICAL(&state_tx_lock);
+    if(!found) return;
+    int index=esp_now_tx_acquire(0,priority);
+    if(index<0){
+      state_frames_dropped++;
+      return;
+    }
+    uint8_t* payload=tx_pool[index].data+HXC_ESPNOW_HEADER_LEN;
+    portENTER_CRITICAL(&state_tx_lock);
+    int len=esp_now_state_pack(payload,mac.mac,priority,now);
+    portEXIT_CRITICAL(&state_tx_lock);
+    if(len==0){
+      esp_now_tx_release(index);
+      continue;
+    }
+    int frame_len=esp_now_encode(tx_pool[index].data,HXC_ESPNOW_STATE_TOPIC,payload,len,0);
+    esp_now_tx_commit(index,mac,frame_len);
+    state_frames_sent++;
+  }
+}
+
+/**
+ * @description: 声明一个发布的状态主题并设置发送频率,已声明的主题只修改设置
+ * @return {esp_err_t} 成功返回ESP_OK,主题数已满返回ESP_ERR_NO_MEM
+ * @param {uint16_t} topic_id 主题ID
+ * @param {uint32_t} rate_hz 最高发送频率,0为每个调度周期都可以发送
+ * @param {MAC_t} receive_MAC 接收数据的设备MAC 默认广播地址
+ * @param {uint8_t} priority 发送优先级
+ */
+esp_err_t esp_now_state_advertise(uint16_t topic_id,uint32_t rate_hz=HXC_ESPNOW_STATE_RATE_HZ,MAC_t receive_MAC=broadcastMacAddress,uint8_t priority=HXC_ESPNOW_PRIO_NORMAL){
+  if(state_timer==nullptr){
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = esp_now_state_tick;
+    timer_args.dispatch_method = ESP_TIMER_TASK;
+    timer_args.name = "esp_now_state";
+    if(esp_timer_create(&timer_args, &state_timer)!=ESP_OK) return ESP_FAIL;
+    esp_timer_start_periodic(state_timer, uint64_t(HXC_ESPNOW_STATE_TICK_MS)*1000);
+  }
+  esp_err_t err=ESP_OK;
+  portENTER_CRITICAL(&state_tx_lock);
+  HXC_ESPNOW_state_tx_t* slot=esp_now_state_tx_find(topic_id);
+  if(slot==nullptr&&state_tx_num<HXC_ESPNOW_STATE_MAX_TOPIC){
+    slot=&state_tx[state_tx_num++];
+    slot->topic_id=topic_id;
+    slot->len=0;
+    slot->dirty=false;
+    slot->next_us=0;
+  }
+  if(slot!=nullptr){
+    memcpy(slot->mac,receive_MAC.mac,6);
+    slot->priority=priority;
+    slot->interval_us=rate_hz>0?1000000/rate_hz:0;
+  }else{
+    err=ESP_ERR_NO_MEM;
+  }
+  portEXIT_CRITICAL(&state_tx_lock);
+  return err;
+}
+
+/**
+ * @description: 发布状态主题的最新值,只覆盖发送槽不阻塞,由调度周期按频率上限发出,未声明的主题按默认设置声明
+ * @return {esp_err_t} 成功返回ESP_OK,数据过长返回ESP_ERR_INVALID_SIZE,主题数已满返回ESP_ERR_NO_MEM
+ * @param {uint16_t} topic_id 主题ID
+ * @param {const void*} data 数据
+ * @param {int} datalen 数据长度,不超过HXC_ESPNOW_STATE_MAX_SIZE
+ */
+esp_err_t esp_now_state_publish(uint16_t topic_id,const void* data,int datalen){
+  if(datalen<0||datalen>HXC_ESPNOW_STATE_MAX_SIZE) return ESP_ERR_INVALID_SIZE;
+  portENTER_CRITICAL(&state_tx_lock);
+  HXC_ESPNOW_state_tx_t* slot=esp_now_state_tx_find(topic_id);
+  if(slot!=nullptr){
+    if(slot->dirty) state_coalesced++;
+    memcpy(slot->data,data,datalen);
+    slot->len=datalen;
+    slot->dirty=true;
+    state_published++;
+  }
+  portEXIT_CRITICAL(&state_tx_lock);
+  if(slot!=nullptr) return ESP_OK;
+  esp_err_t err=esp_now_state_advertise(topic_id);
+  if(err!=ESP_OK) return err;
+  return esp_now_state_publish(topic_id,data,datalen);
+}
+
+//状态帧回调,在分发任务中运行,拆出每个条目写入对应的接收槽
+static void esp_now_state_receive(const HXC_ESPNOW_view& view){
+  int pos=0;
+  while(pos+HXC_ESPNOW_STATE_ENTRY_HEADER_LEN<=view.data_len){
+    uint16_t topic_id=view.data[pos]|(view.data[pos+1]<<8);
+    int len=view.data[pos+2];
+    const uint8_t* data=view.data+pos+HXC_ESPNOW_STATE_ENTRY_HEADER_LEN;
+    pos+=HXC_ESPNOW_STATE_ENTRY_HEADER_LEN+len;
+    if(pos>view.data_len){
+      state_unknown++;
+      return;
+    }
+    HXC_ESPNOW_state_rx_t* slot=esp_now_state_rx_find(topic_id);
+    if(slot==nullptr||len>HXC_ESPNOW_STATE_MAX_SIZE){
+      state_unknown++;
+      continue;
+    }
+    //写入期间关闭本核调度,同一核上的读取者不会在写到一半时抢占后一直重试
+    portENTER_CRITICAL(&state_rx_lock);
+    slot->version.fetch_add(1,std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(slot->data,data,len);
+    slot->len=len;
+    memcpy(slot->mac,view.mac,6);
+    slot->rx_us=view.rx_us;
+    slot->updates++;
+    slot->version.fetch_add(1,std::memory_order_release);
+    portEXIT_CRITICAL(&state_rx_lock);
+    state_received++;
+    if(slot->callback){
+      HXC_ESPNOW_view entry=view;
+      entry.topic_id=topic_id;
+      entry.data=data;
+      entry.data_len=len;
+      slot->callback(entry);
+    }
+  }
+}
+
+/**
+ * @description: 订阅状态主题,之后收到的最新值保存在接收槽中,需在esp_now_setup之后、收到数据之前调用
+ * @return {esp_err_t} 成功返回ESP_OK,主题数已满返回ESP_ERR_NO_MEM
+ * @param {uint16_t} topic_id 主题ID
+ * @param {topic_callback_func} func 可选,每次收到新值时在分发任务中调用,view.topic_id为状态主题ID
+ */
+esp_err_t esp_now_state_subscribe(uint16_t topic_id,topic_callback_func func=nullptr){
+  add_esp_now_topic_callback(HXC_ESPNOW_STATE_TOPIC,esp_now_state_receive);
+  HXC_ESPNOW_state_rx_t* slot=esp_now_state_rx_find(topic_id);
+  if(slot!=nullptr){
+    slot->callback=func;
+    return ESP_OK;
+  }
+  int index=-1;
+  portENTER_CRITICAL(&state_rx_lock);
+  int num=state_rx_num.load(std::memory_order_relaxed);
+  if(num<HXC_ESPNOW_STATE_MAX_TOPIC){
+    index=num;
+    state_rx[index].topic_id=topic_id;
+    state_rx[index].updates=0;
+    state_rx[index].len=0;
+    state_rx_num.store(num+1,std::memory_order_release);
+  }
+  portEXIT_CRITICAL(&state_rx_lock);
+  if(index<0) return ESP_ERR_NO_MEM;
+  state_rx[index].callback=func;
+  return ESP_OK;
+}
+
+/**
+ * @description: 读取状态主题的最新值,读到的总是同一次更新的完整数据
+ * @return {int} 数据长度,未订阅或还没有收到时返回-1
+ * @param {uint16_t} topic_id 主题ID
+ * @param {void*} out 输出缓冲区
+ * @param {int} maxlen 输出缓冲区长度,数据更长时只拷贝前maxlen字节
+ * @param {HXC_ESPNOW_state_info_t*} info 可选,输出更新数、数据年龄和发送方
+ */
+int esp_now_state_read(uint16_t topic_id,void* out,int maxlen,HXC_ESPNOW_state_info_t* info=nullptr){
+  HXC_ESPNOW_state_rx_t* slot=esp_now_state_rx_find(topic_id);
+  if(slot==nullptr) return -1;
+  uint32_t version,updates;
+  int len;
+  int64_t rx_us;
+  uint8_t mac[6];
+  do{
+    version=slot->version.load(std::memory_order_acquire);
+    updates=slot->updates;
+    len=slot->len;
+    rx_us=slot->rx_us;
+    memcpy(mac,slot->mac,6);
+    memcpy(out,slot->data,len<maxlen?len:maxlen);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }while((version&1)||slot->version.load(std::memory_order_relaxed)!=version);
+  if(updates==0) return -1;
+  if(info!=nullptr){
+    info->updates=updates;
+    info->age_us=esp_timer_get_time()-rx_us;
+    memcpy(info->mac,mac,6);
+  }
+  return len;
+}
+
+/**
+ * @description: 声明类型化状态主题并设置发送频率
+ * @param {uint32_t} rate_hz 最高发送频率
+ * @param {MAC_t} receive_MAC 接收数据的设备MAC 默认广播地址
+ * @param {uint8_t} priority 发送优先级
+ */
+template<class T>
+esp_err_t esp_now_state_advertise(uint32_t rate_hz=HXC_ESPNOW_STATE_RATE_HZ,MAC_t receive_MAC=broadcastMacAddress,uint8_t priority=HXC_ESPNOW_PRIO_NORMAL){
+  return esp_now_state_advertise(T::hxc_topic_id(),rate_hz,receive_MAC,priority);
+}
+
+//发布类型化状态,格式与esp_now_publish相同(结构校验值+字段)
+template<class T>
+esp_err_t esp_now_state_publish(const T& msg){
+  typedef hxc_espnow_detail::message<T> message_t;
+  static_assert(HXC_ESPNOW_TYPED_HEADER_LEN+message_t::size<=HXC_ESPNOW_STATE_MAX_SIZE,"message too large for a state topic");
+  uint8_t buf[HXC_ESPNOW_TYPED_HEADER_LEN+message_t::size];
+  uint32_t schema=message_t::schema;
+  memcpy(buf,&schema,HXC_ESPNOW_TYPED_HEADER_LEN);
+  message_t::info::template write<0>(buf+HXC_ESPNOW_TYPED_HEADER_LEN,msg.hxc_fields());
+  return esp_now_state_publish(T::hxc_topic_id(),buf,sizeof(buf));
+}
+
+/**
+ * @description: 订阅类型化状态主题
+ * @param {std::function<void(const T&)>} func 可选,每次收到新值时在分发任务中调用,结构校验值不符的值不会调用
+ */
+template<class T>
+esp_err_t esp_now_state_subscribe(std::function<void(const T&)> func=nullptr){
+  typedef hxc_espnow_detail::message<T> message_t;
+  if(!func) return esp_now_state_subscribe(T::hxc_topic_id());
+  return esp_now_state_subscribe(T::hxc_topic_id(),[func](const HXC_ESPNOW_view& view){
+    uint32_t schema;
+    if(view.data_len!=HXC_ESPNOW_TYPED_HEADER_LEN+message_t::size) return;
+    memcpy(&schema,view.data,HXC_ESPNOW_TYPED_HEADER_LEN);
+    if(schema!=message_t::schema) return;
+    T msg;
+    message_t::info::template read<0>(view.data+HXC_ESPNOW_TYPED_HEADER_LEN,msg.hxc_fields());
+    func(msg);
+  });
+}
+
+/**
+ * @description: 读取类型化状态主题的最新值
+ * @return {bool} 已收到且长度和结构校验值相符返回true,否则msg不变
+ * @param {T&} msg 输出
+ * @param {HXC_ESPNOW_state_info_t*} info 可选,输出更新数、数据年龄和发送方
+ */
+template<class T>
+bool esp_now_state_get(T& msg,HXC_ESPNOW_state_info_t* info=nullptr){
+  typedef hxc_espnow_detail::message<T> message_t;
+  uint8_t buf[HXC_ESPNOW_TYPED_HEADER_LEN+message_t::size];
+  int len=esp_now_state_read(T::hxc_topic_id(),buf,sizeof(buf),info);
+  if(len!=int(sizeof(buf))) return false;
+  uint32_t schema;
+  memcpy(&schema,buf,HXC_ESPNOW_TYPED_HEADER_LEN);
+  if(schema!=message_t::schema) return false;
+  message_t::info::template read<0>(buf+HXC_ESPNOW_TYPED_HEADER_LEN,msg.hxc_fields());
+  return true;
+}
+
+//获取状态主题统计
+HXC_ESPNOW_state_stats_t esp_now_get_state_stats(){
+  HXC_ESPNOW_state_stats_t stats;
+  stats.published=state_published;
+  stats.coalesced=state_coalesced;
+  stats.entries_sent=state_entries_sent;
+  stats.frames_sent=state_frames_sent;
+  stats.frames_dropped=state_frames_dropped;
+  stats.received=state_received;
+  stats.unknown=state_unknown;
+  return stats;
+}
+
+#endif
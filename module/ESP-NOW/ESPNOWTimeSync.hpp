@@ -0,0 +1,293 @@
+/*
+ * @Description: ESP-NOW板间时间同步,类似NTP的四时间戳交换,按最小往返延时筛选样本,线性拟合主机时钟的偏差和漂移
+ * @Author: qingmeijiupiao
+ */
+#ifndef ESPNOWTimeSync_hpp
+#define ESPNOWTimeSync_hpp
+#include "ESPNOW.hpp"
+#include "esp_timer.h"
+
+//同步主题,请求为 类型(1,0请求1回复) | 随机数(4) | t1(8),回复在请求后追加 t2(8) | t3(8)
+#define HXC_ESPNOW_SYNC_TOPIC ESPNOW_TOPIC_ID("HXC_sync")
+#define HXC_ESPNOW_SYNC_REQUEST_LEN 13
+#define HXC_ESPNOW_SYNC_REPLY_LEN 29
+
+//从机发送同步请求的周期,单位ms
+#ifndef HXC_ESPNOW_SYNC_PERIOD_MS
+#define HXC_ESPNOW_SYNC_PERIOD_MS 100
+#endif
+
+//最小延时滤波窗口,往返延时比最近这些样本的最小值大HXC_ESPNOW_SYNC_DELAY_TOLERANCE_US以上的样本丢弃
+#define HXC_ESPNOW_SYNC_WINDOW 16
+#ifndef HXC_ESPNOW_SYNC_DELAY_TOLERANCE_US
+#define HXC_ESPNOW_SYNC_DELAY_TOLERANCE_US 40
+#endif
+
+//拟合偏差和漂移使用的样本数
+#ifndef HXC_ESPNOW_SYNC_POINTS
+#define HXC_ESPNOW_SYNC_POINTS 32
+#endif
+
+//连续HXC_ESPNOW_SYNC_STEP_COUNT个样本与拟合结果相差超过该值认为主机时钟跳变(如主机重启),丢弃旧样本重新同步,单位us
+#define HXC_ESPNOW_SYNC_STEP_US 2000
+#define HXC_ESPNOW_SYNC_STEP_COUNT 3
+
+//漂移上限,晶振误差一般在几十ppm以内,单位ppm
+#define HXC_ESPNOW_SYNC_MAX_DRIFT_PPM 200
+
+//超过该时间没有有效样本认为失去同步,单位ms
+#ifndef HXC_ESPNOW_SYNC_TIMEOUT_MS
+#define HXC_ESPNOW_SYNC_TIMEOUT_MS 2000
+#endif
+
+//时间同步状态
+struct HXC_ESPNOW_sync_stats_t {
+  bool synced;//是否在超时内有有效样本
+  int64_t offset_us;//当前时刻主机时间减本机时间
+  float drift_ppm;//主机时钟相对本机时钟的快慢
+  int32_t delay_us;//窗口内最小往返延时,不含主机处理时间
+  int32_t error_us;//拟合残差的均方根,反映样本噪声,不含两个方向固定延时不对称引入的误差
+  uint32_t samples;//收到的回复数
+  uint32_t accepted;//通过最小延时筛选的样本数
+  uint32_t resets;//检测到主机时钟跳变的次数
+};
+
+//一个通过筛选的样本
+struct HXC_ESPNOW_sync_point_t {
+  int64_t local_us;//请求和回复的中点,本机时间
+  int64_t offset_us;
+};
+
+//以下只在分发任务中访问
+static bool sync_master=false;
+static MAC_t sync_master_mac;
+static uint32_t sync_nonce=0;
+static int32_t sync_delays[HXC_ESPNOW_SYNC_WINDOW];
+static uint32_t sync_samples=0;
+static uint32_t sync_accepted=0;
+static uint32_t sync_resets=0;
+static int sync_step_count=0;//连续偏离拟合结果的样本数
+static HXC_ESPNOW_sync_point_t sync_points[HXC_ESPNOW_SYNC_POINTS];
+static int sync_point_num=0;
+static int sync_point_head=0;
+static esp_timer_handle_t sync_timer=nullptr;
+
+//拟合结果,分发任务写入,任何任务读取,用版本号保证一致
+static std::atomic<uint32_t> sync_version{0};
+static bool sync_valid=false;
+static int64_t sync_ref_local_us=0;//拟合的参考时刻,本机时间
+static int64_t sync_ref_offset_us=0;//参考时刻的偏差
+static int32_t sync_drift_ppb=0;
+static int32_t sync_delay_us=0;
+static int32_t sync_error_us=0;
+static int64_t sync_last_us=0;//最近一个有效样本的时间
+
+/**
+ * @description: 加入一组时间戳,按最小延时筛选后重新拟合偏差和漂移
+ * @param {int64_t} t1 从机发送请求的时间,本机时钟
+ * @param {int64_t} t2 主机收到请求的时间,主机时钟
+ * @param {int64_t} t3 主机发送回复的时间,主机时钟
+ * @param {int64_t} t4 从机收到回复的时间,本机时钟
+ */
+static void esp_now_sync_sample(int64_t t1,int64_t t2,int64_t t3,int64_t t4){
+  int64_t delay=(t4-t1)-(t3-t2);
+  if(delay<0||t3<t2||delay>INT32_MAX) return;
+  sync_delays[sync_samples%HXC_ESPNOW_SYNC_WINDOW]=int32_t(delay);
+  sync_samples++;
+  //排队和重传只会增大延时,且多半只发生在一个方向,延时接近最小值的样本偏差最准
+  int window=sync_samples<HXC_ESPNOW_SYNC_WINDOW?sync_samples:HXC_ESPNOW_SYNC_WINDOW;
+  int32_t min_delay=sync_delays[0];
+  for(int i=1;i<window;i++){
+    if(sync_delays[i]<min_delay) min_delay=sync_delays[i];
+  }
+  if(delay>min_delay+HXC_ESPNOW_SYNC_DELAY_TOLERANCE_US) return;
+  HXC_ESPNOW_sync_point_t point;
+  point.local_us=t1+(t4-t1)/2;
+  point.offset_us=((t2-t1)+(t3-t4))/2;
+  //与当前拟合结果相差太大说明主机时钟跳变
+  if(sync_point_num>0){
+    int64_t predict=sync_ref_offset_us+(point.local_us-sync_ref_local_us)*sync_drift_ppb/1000000000;
+    int64_t diff=point.offset_us-predict;
+    if(diff>HXC_ESPNOW_SYNC_STEP_US||diff<-HXC_ESPNOW_SYNC_STEP_US){
+      //单个离群样本直接丢弃
+      if(++sync_step_count<HXC_ESPNOW_SYNC_STEP_COUNT) return;
+      sync_point_num=0;
+      sync_resets++;
+    }
+    sync_step_count=0;
+  }
+  sync_points[sync_point_head]=point;
+  sync_point_head=(sync_point_head+1)%HXC_ESPNOW_SYNC_POINTS;
+  if(sync_point_num<HXC_ESPNOW_SYNC_POINTS) sync_point_num++;
+  sync_accepted++;
+
+  //最小二乘拟合 偏差=a+b*(时间-参考时刻),以最新样本为参考减小数值误差
+  double mean_x=0,mean_y=0;
+  for(int i=0;i<sync_point_num;i++){
+    const HXC_ESPNOW_sync_point_t& p=sync_points[(sync_point_head-1-i+HXC_ESPNOW_SYNC_POINTS)%HXC_ESPNOW_SYNC_POINTS];
+    mean_x+=double(p.local_us-point.local_us);
+    mean_y+=double(p.offset_us-point.offset_us);
+  }
+  mean_x/=sync_point_num;
+  mean_y/=sync_point_num;
+  double sxx=0,sxy=0;
+  for(int i=0;i<sync_point_num;i++){
+    const HXC_ESPNOW_sync_point_t& p=sync_points[(sync_point_head-1-i+HXC_ESPNOW_SYNC_POINTS)%HXC_ESPNOW_SYNC_POINTS];
+    double dx=double(p.local_us-point.local_us)-mean_x;
+    double dy=double(p.offset_us-point.offset_us)-mean_y;
+    sxx+=dx*dx;
+    sxy+=dx*dy;
+  }
+  //样本跨度太短时漂移不可信,保持上一次的结果
+  double drift=sync_drift_ppb*1e-9;
+  if(sync_point_num>=4&&sxx>0) drift=sxy/sxx;
+  if(drift>HXC_ESPNOW_SYNC_MAX_DRIFT_PPM*1e-6) drift=HXC_ESPNOW_SYNC_MAX_DRIFT_PPM*1e-6;
+  if(drift<-HXC_ESPNOW_SYNC_MAX_DRIFT_PPM*1e-6) drift=-HXC_ESPNOW_SYNC_MAX_DRIFT_PPM*1e-6;
+  double offset=mean_y-drift*mean_x;
+  double residual=0;
+  for(int i=0;i<sync_point_num;i++){
+    const HXC_ESPNOW_sync_point_t& p=sync_points[(sync_point_head-1-i+HXC_ESPNOW_SYNC_POINTS)%HXC_ESPNOW_SYNC_POINTS];
+    double r=double(p.offset_us-point.offset_us)-(offset+drift*double(p.local_us-point.local_us));
+    residual+=r*r;
+  }
+
+  sync_version.fetch_add(1,std::memory_order_acq_rel);
+  sync_valid=true;
+  sync_ref_local_us=point.local_us;
+  sync_ref_offset_us=point.offset_us+int64_t(offset>=0?offset+0.5:offset-0.5);
+  sync_drift_ppb=int32_t(drift*1e9);
+  sync_delay_us=min_delay;
+  sync_error_us=int32_t(sqrt(residual/sync_point_num)+0.5);
+  sync_last_us=t4;
+  sync_version.fetch_add(1,std::memory_order_release);
+}
+
+/**
+ * @description: 把本机时间换算为同步时间,可用于给之前采集的数据打时间戳
+ * @return {int64_t} 同步时间,单位us;主机或尚未同步时返回本机时间
+ * @param {int64_t} local_us 本机时间,esp_timer_get_time()
+ */
+int64_t esp_now_local_to_synced(int64_t local_us){
+  if(sync_master) return local_us;
+  uint32_t version;
+  bool valid;
+  int64_t ref_local,ref_offset;
+  int32_t drift;
+  do{
+    version=sync_version.load(std::memory_order_acquire);
+    valid=sync_valid;
+    ref_local=sync_ref_local_us;
+    ref_offset=sync_ref_offset_us;
+    drift=sync_drift_ppb;
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }while((version&1)||sync_version.load(std::memory_order_relaxed)!=version);
+  if(!valid) return local_us;
+  return local_us+ref_offset+(local_us-ref_local)*drift/1000000000;
+}
+
+/**
+ * @description: 获取同步时间,所有同步到同一主机的板子读到的是同一个时钟
+ * @return {int64_t} 同步时间,单位us;主机或尚未同步时返回本机时间
+ */
+int64_t synced_time_us(){
+  return esp_now_local_to_synced(esp_timer_get_time());
+}
+
+//同步主题回调,在分发任务中运行
+static void esp_now_sync_callback(const HXC_ESPNOW_view& view){
+  if(view.data_len==HXC_ESPNOW_SYNC_REQUEST_LEN&&view.data[0]==0){
+    if(!sync_master) return;
+    //回复用广播发送,不需要与从机配对;t3尽量晚取
+    uint8_t reply[HXC_ESPNOW_SYNC_REPLY_LEN];
+    memcpy(reply,view.data,HXC_ESPNOW_SYNC_REQUEST_LEN);
+    reply[0]=1;
+    memcpy(reply+13,&view.rx_us,8);
+    int64_t t3=esp_timer_get_time();
+    memcpy(reply+21,&t3,8);
+    esp_now_send_topic(HXC_ESPNOW_SYNC_TOPIC,reply,HXC_ESPNOW_SYNC_REPLY_LEN,broadcastMacAddress,0,HXC_ESPNOW_PRIO_CONTROL);
+    return;
+  }
+  if(view.data_len!=HXC_ESPNOW_SYNC_REPLY_LEN||view.data[0]!=1||sync_master) return;
+  uint32_t nonce;
+  memcpy(&nonce,view.data+1,4);
+  if(nonce!=sync_nonce) return;
+  if(sync_master_mac!=broadcastMacAddress&&memcmp(sync_master_mac.mac,view.mac,6)!=0) return;
+  int64_t t1,t2,t3;
+  memcpy(&t1,view.data+5,8);
+  memcpy(&t2,view.data+13,8);
+  memcpy(&t3,view.data+21,8);
+  esp_now_sync_sample(t1,t2,t3,view.rx_us);
+}
+
+//定时发送同步请求
+static void esp_now_sync_tick(void* arg){
+  uint8_t request[HXC_ESPNOW_SYNC_REQUEST_LEN];
+  request[0]=0;
+  memcpy(request+1,&sync_nonce,4);
+  int64_t t1=esp_timer_get_time();
+  memcpy(request+5,&t1,8);
+  esp_now_send_topic(HXC_ESPNOW_SYNC_TOPIC,request,HXC_ESPNOW_SYNC_REQUEST_LEN,sync_master_mac,0,HXC_ESPNOW_PRIO_CONTROL);
+}
+
+//作为时间同步主机,回复其他板子的同步请求,需在esp_now_setup之后调用
+void esp_now_time_sync_master(){
+  sync_master=true;
+  add_esp_now_topic_callback(HXC_ESPNOW_SYNC_TOPIC,esp_now_sync_callback);
+}
+
+/**
+ * @description: 作为从机开始与主机同步时间,需在esp_now_setup之后调用
+ * @param {MAC_t} master_mac 主机MAC,单播需先配对;默认广播,此时网络中只能有一个主机
+ * @param {uint32_t} period_ms 同步请求周期
+ */
+void esp_now_time_sync_begin(MAC_t master_mac=broadcastMacAddress,uint32_t period_ms=HXC_ESPNOW_SYNC_PERIOD_MS){
+  sync_master=false;
+  sync_master_mac=master_mac;
+  if(sync_nonce==0) sync_nonce=esp_random()|1;
+  add_esp_now_topic_callback(HXC_ESPNOW_SYNC_TOPIC,esp_now_sync_callback);
+  if(sync_timer==nullptr){
+    esp_timer_create_args_t timer_args = {};
+    timer_args.callback = esp_now_sync_tick;
+    timer_args.dispatch_method = ESP_TIMER_TASK;
+    timer_args.name = "esp_now_sync";
+    esp_timer_create(&timer_args, &sync_timer);
+  }else{
+    esp_timer_stop(sync_timer);
+  }
+  esp_timer_start_periodic(sync_timer, uint64_t(period_ms)*1000);
+}
+
+//停止发送同步请求,已有的拟合结果继续使用直到超时
+void esp_now_time_sync_stop(){
+  if(sync_timer!=nullptr) esp_timer_stop(sync_timer);
+}
+
+//获取时间同步状态
+HXC_ESPNOW_sync_stats_t esp_now_get_sync_stats(){
+  HXC_ESPNOW_sync_stats_t stats;
+  uint32_t version;
+  int64_t last;
+  do{
+    version=sync_version.load(std::memory_order_acquire);
+    stats.drift_ppm=sync_drift_ppb/1000.f;
+    stats.delay_us=sync_delay_us;
+    stats.error_us=sync_error_us;
+    stats.synced=sync_valid;
+    last=sync_last_us;
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }while((version&1)||sync_version.load(std::memory_order_relaxed)!=version);
+  int64_t now=esp_timer_get_time();
+  stats.offset_us=esp_now_local_to_synced(now)-now;
+  stats.synced=sync_master||(stats.synced&&now-last<HXC_ESPNOW_SYNC_TIMEOUT_MS*1000);
+  stats.samples=sync_samples;
+  stats.accepted=sync_accepted;
+  stats.resets=sync_resets;
+  return stats;
+}
+
+//是否已同步到主机,主机总是返回true
+bool esp_now_time_synced(){
+  return esp_now_get_sync_stats().synced;
+}
+
+#endif
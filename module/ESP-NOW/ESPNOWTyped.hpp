@@ -0,0 +1,231 @@
+/*
+ * @Description: ESP-NOW类型化消息,结构体声明主题和字段后直接发布和订阅,编译期生成紧凑小端序列化和结构校验值
+ * @Author: qingmeijiupiao
+ */
+#ifndef ESPNOWTyped_hpp
+#define ESPNOWTyped_hpp
+#include "ESPNOW.hpp"
+#include <tuple>
+#include <type_traits>
+
+//类型化消息子包头: 结构校验值(4),位于v2包头之后
+#define HXC_ESPNOW_TYPED_HEADER_LEN 4
+
+/**
+ * @brief 在结构体中声明消息的主题和参与传输的字段,字段按列出的顺序紧凑排列,不含填充
+ * @note 字段支持整数、浮点、bool、枚举、这些类型的数组以及同样用本宏声明的结构体。
+ *       结构校验值由字段名和字段类型在编译期计算,两端结构不同的消息在接收端直接丢弃
+ * @example
+ *   struct motor_cmd_t {
+ *     float speed;
+ *     int16_t angle;
+ *     uint8_t mode;
+ *     HXC_ESPNOW_MESSAGE("motor_cmd", speed, angle, mode)
+ *   };
+ */
+#define HXC_ESPNOW_MESSAGE(topic_name, ...) \
+  static constexpr uint16_t hxc_topic_id(){ return ESPNOW_TOPIC_ID(topic_name); } \
+  static constexpr uint32_t hxc_names_hash(){ return ESPNOW_HASH32(#__VA_ARGS__); } \
+  auto hxc_fields() -> decltype(std::tie(__VA_ARGS__)) { return std::tie(__VA_ARGS__); } \
+  auto hxc_fields() const -> decltype(std::tie(__VA_ARGS__)) { return std::tie(__VA_ARGS__); }
+
+namespace hxc_espnow_detail {
+
+//结构校验值的一步FNV-1a,按32位整体混入
+constexpr uint32_t hash_step(uint32_t hash,uint32_t value){
+  return (hash^value)*16777619u;
+}
+
+template<class T,class Enable=void>
+struct has_fields:std::false_type{};
+template<class T>
+struct has_fields<T,decltype(void(std::declval<T&>().hxc_fields()))>:std::true_type{};
+
+template<class T,class Enable=void>
+struct field;
+
+template<class Tuple>
+struct message_info;
+
+//整数和浮点,ESP32为小端,直接拷贝即是小端布局
+template<class T>
+struct field<T,typename std::enable_if<std::is_arithmetic<T>::value&&!std::is_same<T,bool>::value>::type>{
+  static constexpr size_t size=sizeof(T);
+  //类型编码: 是否浮点 | 是否有符号 | 字节数
+  static constexpr uint32_t code=(std::is_floating_point<T>::value?0x200u:0u)|(std::is_signed<T>::value?0x100u:0u)|sizeof(T);
+  static void write(uint8_t* out,const T& value){ memcpy(out,&value,sizeof(T)); }
+  static void read(const uint8_t* in,T& value){ memcpy(&value,in,sizeof(T)); }
+};
+
+//bool按1字节传输,接收时任何非0值都是true
+template<>
+struct field<bool>{
+  static constexpr size_t size=1;
+  static constexpr uint32_t code=0x400u|1u;
+  static void write(uint8_t* out,const bool& value){ *out=value?1:0; }
+  static void read(const uint8_t* in,bool& value){ value=*in!=0; }
+};
+
+//枚举按底层类型传输
+template<class T>
+struct field<T,typename std::enable_if<std::is_enum<T>::value>::type>{
+  typedef typename std::underlying_type<T>::type base_t;
+  static constexpr size_t size=field<base_t>::size;
+  static constexpr uint32_t code=0x800u|field<base_t>::code;
+  static void write(uint8_t* out,const T& value){ field<base_t>::write(out,base_t(value)); }
+  static void read(const uint8_t* in,T& value){
+    base_t base;
+    field<base_t>::read(in,base);
+    value=T(base);
+  }
+};
+
+//数组逐个元素排列
+template<class T,size_t N>
+struct field<T[N]>{
+  static constexpr size_t size=N*field<T>::size;
+  static constexpr uint32_t code=hash_step(hash_step(0x1000u,field<T>::code),N);
+  static void write(uint8_t* out,const T (&value)[N]){
+    for(size_t i=0;i<N;i++) field<T>::write(out+i*field<T>::size,value[i]);
+  }
+  static void read(const uint8_t* in,T (&value)[N]){
+    for(size_t i=0;i<N;i++) field<T>::read(in+i*field<T>::size,value[i]);
+  }
+};
+
+//嵌套的消息结构体,字段直接展开,不带子包头
+template<class T>
+struct field<T,typename std::enable_if<has_fields<T>::value>::type>{
+  typedef message_info<decltype(std::declval<T&>().hxc_fields())> info;
+  static constexpr size_t size=info::size;
+  static constexpr uint32_t code=info::hash(T::hxc_names_hash());
+  static void write(uint8_t* out,const T& value){ info::template write<0>(out,value.hxc_fields()); }
+  static void read(const uint8_t* in,T& value){ info::template read<0>(in,value.hxc_fields()); }
+};
+
+//字段类型列表的长度和校验值
+template<class... F>
+struct fields_info;
+
+template<>
+struct fields_info<>{
+  static constexpr size_t size=0;
+  static constexpr uint32_t hash(uint32_t hash){ return hash; }
+};
+
+template<class F,class... R>
+struct fields_info<F,R...>{
+  static constexpr size_t size=field<F>::size+fields_info<R...>::size;
+  static constexpr uint32_t hash(uint32_t hash){ return fields_info<R...>::hash(hash_step(hash,field<F>::code)); }
+};
+
+//hxc_fields()返回各字段引用组成的tuple,按下标逐个读写
+template<class... F>
+struct message_info<std::tuple<F&...>>:fields_info<typename std::remove_const<F>::type...>{
+  typedef std::tuple<typename std::remove_const<F>::type...> types;
+
+  template<size_t I,class Tuple>
+  static typename std::enable_if<I==sizeof...(F)>::type write(uint8_t*,const Tuple&){}
+  template<size_t I,class Tuple>
+  static typename std::enable_if<(I<sizeof...(F))>::type write(uint8_t* out,const Tuple& fields){
+    typedef typename std::tuple_element<I,types>::type field_t;
+    field<field_t>::write(out,std::get<I>(fields));
+    write<I+1>(out+field<field_t>::size,fields);
+  }
+
+  template<size_t I,class Tuple>
+  static typename std::enable_if<I==sizeof...(F)>::type read(const uint8_t*,const Tuple&){}
+  template<size_t I,class Tuple>
+  static typename std::enable_if<(I<sizeof...(F))>::type read(const uint8_t* in,const Tuple& fields){
+    typedef typename std::tuple_element<I,types>::type field_t;
+    field<field_t>::read(in,std::get<I>(fields));
+    read<I+1>(in+field<field_t>::size,fields);
+  }
+};
+
+//消息T序列化后的长度和结构校验值
+template<class T>
+struct message{
+  static_assert(has_fields<T>::value,"message type must declare its fields with HXC_ESPNOW_MESSAGE");
+  typedef message_info<decltype(std::declval<T&>().hxc_fields())> info;
+  static constexpr size_t size=info::size;
+  static constexpr uint32_t schema=info::hash(T::hxc_names_hash());
+  static_assert(HXC_ESPNOW_TYPED_HEADER_LEN+size<=HXC_ESPNOW_MAX_PAYLOAD,"message too large for one ESP-NOW packet");
+};
+
+}
+
+//类型化消息统计
+struct HXC_ESPNOW_typed_stats_t {
+  uint32_t published;//放入发送队列的消息数
+  uint32_t received;//校验通过交给回调的消息数
+  uint32_t rejected;//长度或结构校验值不符丢弃的消息数
+};
+
+static volatile uint32_t typed_published=0;
+static volatile uint32_t typed_received=0;
+static volatile uint32_t typed_rejected=0;
+
+/**
+ * @description: 发布类型化消息,直接序列化到发送缓冲池的帧中,不阻塞
+ * @return {esp_err_t} 成功放入发送队列返回ESP_OK,队列满返回ESP_ERR_NO_MEM
+ * @param {const T&} msg 用HXC_ESPNOW_MESSAGE声明过的消息
+ * @param {MAC_t} receive_MAC 接收数据的设备MAC 默认广播地址
+ * @param {uint8_t} priority 发送优先级
+ */
+template<class T>
+esp_err_t esp_now_publish(const T& msg,MAC_t receive_MAC=broadcastMacAddress,uint8_t priority=HXC_ESPNOW_PRIO_NORMAL){
+  typedef hxc_espnow_detail::message<T> message_t;
+  int index=esp_now_tx_acquire(0,priority);
+  if(index<0) return ESP_ERR_NO_MEM;
+  uint8_t* payload=tx_pool[index].data+HXC_ESPNOW_HEADER_LEN;
+  uint32_t schema=message_t::schema;
+  memcpy(payload,&schema,HXC_ESPNOW_TYPED_HEADER_LEN);
+  message_t::info::template write<0>(payload+HXC_ESPNOW_TYPED_HEADER_LEN,msg.hxc_fields());
+  int len=esp_now_encode(tx_pool[index].data,T::hxc_topic_id(),payload,HXC_ESPNOW_TYPED_HEADER_LEN+message_t::size,0);
+  esp_now_tx_commit(index,receive_MAC,len);
+  typed_published++;
+  return ESP_OK;
+}
+
+/**
+ * @description: 订阅类型化消息,占用该消息主题的主题回调
+ * @param {std::function<void(const T&)>} func 回调函数,在分发任务中运行,长度或结构校验值不符的消息不会调用
+ */
+template<class T>
+void esp_now_subscribe(std::function<void(const T&)> func){
+  typedef hxc_espnow_detail::message<T> message_t;
+  add_esp_now_topic_callback(T::hxc_topic_id(),[func](const HXC_ESPNOW_view& view){
+    uint32_t schema;
+    if(view.data_len!=HXC_ESPNOW_TYPED_HEADER_LEN+message_t::size){
+      typed_rejected++;
+      return;
+    }
+    memcpy(&schema,view.data,HXC_ESPNOW_TYPED_HEADER_LEN);
+    if(schema!=message_t::schema){
+      typed_rejected++;
+      return;
+    }
+    T msg;
+    message_t::info::template read<0>(view.data+HXC_ESPNOW_TYPED_HEADER_LEN,msg.hxc_fields());
+    typed_received++;
+    func(msg);
+  });
+}
+
+//取消订阅类型化消息
+template<class T>
+void esp_now_unsubscribe(){
+  remove_esp_now_topic_callback(T::hxc_topic_id());
+}
+
+//获取类型化消息统计
+HXC_ESPNOW_typed_stats_t esp_now_get_typed_stats(){
+  HXC_ESPNOW_typed_stats_t stats;
+  stats.published=typed_published;
+  stats.received=typed_received;
+  stats.rejected=typed_rejected;
+  return stats;
+}
+
+#endif
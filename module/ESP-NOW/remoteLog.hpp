@@ -0,0 +1,303 @@
+/*
+ * @Description: 二进制远程日志,只发送格式ID和原始参数,在接收端格式化
+ * @Author: qingmeijiupiao
+ */
+#ifndef remoteLog_hpp
+#define remoteLog_hpp
+
+#include "ESPNOW.hpp"
+#include "remoteLogFormat.hpp"
+#include "esp_timer.h"
+#include <map>
+
+// 日志记录数据包的主题
+#define REMOTE_LOG_TOPIC ESPNOW_TOPIC_ID("remoteLog")
+
+// 格式串公告数据包的主题，内容为 格式ID(4字节) | 格式串(不含'\0')
+#define REMOTE_LOG_FORMAT_TOPIC ESPNOW_TOPIC_ID("remoteLogFmt")
+
+// 缓冲区中的记录超过该时间没有发送会由定时器发送，单位ms
+#ifndef REMOTE_LOG_FLUSH_MS
+#define REMOTE_LOG_FLUSH_MS 10
+#endif
+
+// 已使用的格式串每隔该时间轮流重发一个，后启动的接收端也能拿到全部格式串，单位ms
+#ifndef REMOTE_LOG_ANNOUNCE_MS
+#define REMOTE_LOG_ANNOUNCE_MS 200
+#endif
+
+// 记录的格式串数量上限，超出的格式串只在第一次使用时公告；也是接收端格式串表的容量
+#ifndef REMOTE_LOG_MAX_FORMAT
+#define REMOTE_LOG_MAX_FORMAT 64
+#endif
+
+/**
+ * @brief 发送一条二进制日志，用法与printf相同，格式串必须是字符串常量
+ * @note 格式ID在编译期由格式串哈希得到，发送端不做任何格式化，只拷贝参数的原始值。
+ *       不能在中断中调用
+ */
+#define remote_log(fmt, ...) remoteLogger.log<REMOTE_LOG_HASH(fmt)>(fmt, ##__VA_ARGS__)
+
+// 二进制远程日志类
+// 多条记录先写入所在核心的缓冲区，缓冲区放不下或超时才发送一个数据包
+class remoteLog_t {
+private:
+    remoteLog_t() {}
+    remoteLog_t(const remoteLog_t&) = delete;
+    remoteLog_t& operator=(const remoteLog_t&) = delete;
+
+    static remoteLog_t* instance;
+
+    // 接收端的MAC地址
+    MAC_t receive_MAC = broadcastMacAddress;
+
+    // 每个核心一个记录缓冲区，与remotePrint相同
+    struct buffer_t {
+        uint8_t data[HXC_ESPNOW_MAX_PAYLOAD];
+        size_t len = 0;
+        int64_t first_write_us = 0;
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    };
+    buffer_t buffers[portNUM_PROCESSORS];
+
+    // 已使用的格式串，定时轮流重发
+    uint32_t format_ids[REMOTE_LOG_MAX_FORMAT];
+    const char* formats[REMOTE_LOG_MAX_FORMAT];
+    int format_num = 0;
+    int announce_index = 0;
+    int64_t last_announce_us = 0;
+    portMUX_TYPE format_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    esp_timer_handle_t flush_timer = nullptr;
+
+    // 接收端的格式串表，只在分发任务中访问，最多REMOTE_LOG_MAX_FORMAT条
+    std::map<uint32_t, String> format_table;
+    uint32_t format_order[REMOTE_LOG_MAX_FORMAT];  // 按收到顺序记录格式ID，表满时淘汰最早的
+    int format_order_index = 0;
+    std::function<void(const uint8_t*, const char*)> sink = nullptr;
+
+    // 统计
+    volatile uint32_t record_count = 0;  // 写入的记录数
+    volatile uint32_t packet_count = 0;  // 发送的数据包数
+    volatile uint32_t byte_count = 0;    // 发送的记录字节数，不含格式串公告
+    volatile uint32_t dropped_count = 0; // 发送队列满丢弃的数据包数
+
+    void send_packet(const uint8_t* data, size_t len) {
+        if (esp_now_send_topic(REMOTE_LOG_TOPIC, data, len, receive_MAC, 0, HXC_ESPNOW_PRIO_LOW) == ESP_OK) {
+            packet_count++;
+            byte_count += len;
+        } else {
+            dropped_count++;
+        }
+    }
+
+    // 发送一个格式串公告，格式串过长时截断
+    bool send_format(uint32_t id, const char* fmt) {
+        uint8_t packet[HXC_ESPNOW_MAX_PAYLOAD];
+        size_t len = strnlen(fmt, HXC_ESPNOW_MAX_PAYLOAD - 4);
+        memcpy(packet, &id, 4);
+        memcpy(packet + 4, fmt, len);
+        return esp_now_send_topic(REMOTE_LOG_FORMAT_TOPIC, packet, 4 + len, receive_MAC, 0, HXC_ESPNOW_PRIO_LOW) == ESP_OK;
+    }
+
+    // 格式串第一次使用时记录并公告，公告失败下次使用时再发
+    bool announce(uint32_t id, const char* fmt) {
+        portENTER_CRITICAL(&format_lock);
+        bool found = false;
+        for (int i = 0; i < format_num; i++) {
+            if (format_ids[i] == id) {
+                found = true;
+                break;
+            }
+        }
+        if (!found && format_num < REMOTE_LOG_MAX_FORMAT) {
+            format_ids[format_num] = id;
+            formats[format_num] = fmt;
+            format_num++;
+        }
+        portEXIT_CRITICAL(&format_lock);
+        return send_format(id, fmt);
+    }
+
+    // 追加一条记录，放不下时先把缓冲区作为一个数据包发出
+    void append_record(const uint8_t* record, size_t len) {
+        buffer_t& local = buffers[xPortGetCoreID()];
+        uint8_t packet[HXC_ESPNOW_MAX_PAYLOAD];
+        size_t packet_len = 0;
+        portENTER_CRITICAL(&local.lock);
+        if (local.len + len > HXC_ESPNOW_MAX_PAYLOAD) {
+            packet_len = local.len;
+            memcpy(packet, local.data, packet_len);
+            local.len = 0;
+        }
+        if (local.len == 0) local.first_write_us = esp_timer_get_time();
+        memcpy(local.data + local.len, record, len);
+        local.len += len;
+        portEXIT_CRITICAL(&local.lock);
+        record_count++;
+        if (packet_len > 0) send_packet(packet, packet_len);
+    }
+
+    void flush_buffer(buffer_t& buffer, bool timeout_only) {
+        uint8_t packet[HXC_ESPNOW_MAX_PAYLOAD];
+        size_t len = 0;
+        portENTER_CRITICAL(&buffer.lock);
+        if (buffer.len > 0 && (!timeout_only || esp_timer_get_time() - buffer.first_write_us >= REMOTE_LOG_FLUSH_MS * 1000)) {
+            len = buffer.len;
+            memcpy(packet, buffer.data, len);
+            buffer.len = 0;
+        }
+        portEXIT_CRITICAL(&buffer.lock);
+        if (len > 0) send_packet(packet, len);
+    }
+
+    // 定时器回调，刷新超时的缓冲区并轮流重发格式串
+    static void flush_timer_callback(void* arg) {
+        remoteLog_t* self = static_cast<remoteLog_t*>(arg);
+        for (int i = 0; i < portNUM_PROCESSORS; i++) {
+            self->flush_buffer(self->buffers[i], true);
+        }
+        int64_t now = esp_timer_get_time();
+        if (now - self->last_announce_us < REMOTE_LOG_ANNOUNCE_MS * 1000) return;
+        self->last_announce_us = now;
+        uint32_t id = 0;
+        const char* fmt = nullptr;
+        portENTER_CRITICAL(&self->format_lock);
+        if (self->format_num > 0) {
+            if (self->announce_index >= self->format_num) self->announce_index = 0;
+            id = self->format_ids[self->announce_index];
+            fmt = self->formats[self->announce_index];
+            self->announce_index++;
+        }
+        portEXIT_CRITICAL(&self->format_lock);
+        if (fmt != nullptr) self->send_format(id, fmt);
+    }
+
+    // 接收格式串公告
+    void on_format(const HXC_ESPNOW_view& view) {
+        if (view.data_len < 4) return;
+        uint32_t id;
+        memcpy(&id, view.data, 4);
+        auto item = format_table.find(id);
+        if (item == format_table.end()) {
+            // 表满时淘汰最早收到的格式串，发送端轮流重发公告，仍在使用的格式串之后会重新收到
+            if (format_table.size() >= REMOTE_LOG_MAX_FORMAT) {
+                format_table.erase(format_order[format_order_index]);
+            }
+            format_order[format_order_index] = id;
+            format_order_index = (format_order_index + 1) % REMOTE_LOG_MAX_FORMAT;
+            item = format_table.insert(std::make_pair(id, String())).first;
+        }
+        String& fmt = item->second;
+        if (fmt.length() == size_t(view.data_len - 4)) return;
+        fmt = "";
+        fmt.reserve(view.data_len - 4);
+        for (int i = 4; i < view.data_len; i++) fmt += char(view.data[i]);
+    }
+
+    // 接收日志记录，逐条还原为文本
+    void on_record(const HXC_ESPNOW_view& view) {
+        char text[256];
+        remote_log_record_t record;
+        int pos = 0;
+        while (pos < view.data_len) {
+            int len = remote_log_parse_record(view.data + pos, view.data_len - pos, record);
+            if (len < 0) break;
+            pos += len;
+            auto item = format_table.find(record.id);
+            if (item == format_table.end()) {
+                // 还没有收到格式串公告
+                snprintf(text, sizeof(text), "<fmt %08x>", unsigned(record.id));
+            } else {
+                remote_log_format(item->second.c_str(), record.args, record.args_len, text, sizeof(text));
+            }
+            if (sink) sink(view.mac, text);
+        }
+    }
+
+public:
+    ~remoteLog_t() {
+        if (flush_timer != nullptr) {
+            esp_timer_stop(flush_timer);
+            esp_timer_delete(flush_timer);
+        }
+        instance = nullptr;
+    }
+
+    static remoteLog_t& getInstance() {
+        if (!instance) {
+            instance = new remoteLog_t();
+        }
+        return *instance;
+    }
+
+    // 发送端初始化
+    // 参数：
+    //   _secret_key: 安全密钥，默认使用DEFAULT_SECRET_KEY
+    //   _receive_MAC: 目标MAC地址，默认使用广播地址
+    void setup(uint16_t _secret_key=DEFAULT_SECRET_KEY, MAC_t _receive_MAC=broadcastMacAddress) {
+        change_secret_key(_secret_key);
+        receive_MAC = _receive_MAC;
+        esp_now_setup(_receive_MAC);
+        if (flush_timer == nullptr) {
+            esp_timer_create_args_t timer_args = {};
+            timer_args.callback = flush_timer_callback;
+            timer_args.arg = this;
+            timer_args.dispatch_method = ESP_TIMER_TASK;
+            timer_args.name = "remoteLog";
+            esp_timer_create(&timer_args, &flush_timer);
+            esp_timer_start_periodic(flush_timer, REMOTE_LOG_FLUSH_MS * 1000 / 2);
+        }
+    }
+
+    // 接收端初始化，每条日志还原成文本后调用sink
+    // 参数：
+    //   _sink: 回调函数，参数为发送端MAC和一行日志文本(不含换行)，在ESP-NOW分发任务中运行
+    void receive(std::function<void(const uint8_t*, const char*)> _sink) {
+        sink = _sink;
+        add_esp_now_topic_callback(REMOTE_LOG_FORMAT_TOPIC, [this](const HXC_ESPNOW_view& view) { on_format(view); });
+        add_esp_now_topic_callback(REMOTE_LOG_TOPIC, [this](const HXC_ESPNOW_view& view) { on_record(view); });
+    }
+
+    // 写入一条日志，一般通过remote_log宏调用
+    template<uint32_t ID, typename... Args>
+    void log(const char* fmt, Args... args) {
+        // 每个格式串一个标志，只在第一次使用时公告
+        static bool announced = false;
+        if (!announced) announced = announce(ID, fmt);
+        uint8_t record[REMOTE_LOG_RECORD_HEADER + 255];
+        int size = HXC_ESPNOW_MAX_PAYLOAD < int(sizeof(record)) ? HXC_ESPNOW_MAX_PAYLOAD : int(sizeof(record));
+        int len = remote_log_encode_record(record, size, ID, args...);
+        append_record(record, len);
+    }
+
+    // 立即发送所有缓冲区中的记录
+    void flush() {
+        for (int i = 0; i < portNUM_PROCESSORS; i++) {
+            flush_buffer(buffers[i], false);
+        }
+    }
+
+    // 写入的记录数
+    uint32_t get_record_count() { return record_count; }
+    // 发送的数据包数
+    uint32_t get_packet_count() { return packet_count; }
+    // 发送的记录字节数
+    uint32_t get_byte_count() { return byte_count; }
+    // 发送队列满丢弃的数据包数
+    uint32_t get_dropped_count() { return dropped_count; }
+
+    static void destroy() {
+        if (instance) {
+            delete instance;
+            instance = nullptr;
+        }
+    }
+};
+
+remoteLog_t* remoteLog_t::instance = nullptr;
+
+// 全局引用，发送端先调用setup()，接收端调用receive()
+remoteLog_t& remoteLogger = remoteLog_t::getInstance();
+
+#endif
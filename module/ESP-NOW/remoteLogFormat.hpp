@@ -0,0 +1,379 @@
+/*
+ * @Description: remote_log二进制日志的参数编码和解码,不依赖Arduino,解码部分可直接在电脑端程序中使用
+ * @Author: qingmeijiupiao
+ */
+#ifndef remoteLogFormat_hpp
+#define remoteLogFormat_hpp
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <type_traits>
+
+//字符串参数最大长度,超出部分截断
+#ifndef REMOTE_LOG_MAX_STRING
+#define REMOTE_LOG_MAX_STRING 32
+#endif
+
+//double参数按float发送,节省4字节,设为0按double发送
+#ifndef REMOTE_LOG_DOUBLE_AS_FLOAT
+#define REMOTE_LOG_DOUBLE_AS_FLOAT 1
+#endif
+
+//记录头长度: 格式ID(4) | 参数长度(1)
+#define REMOTE_LOG_RECORD_HEADER 5
+
+/**
+ * @brief 格式串哈希(FNV-1a),与ESPNOW_HASH32相同,字符串常量在编译期求值
+ * @param str 格式串
+ * @param hash 初始值
+ */
+constexpr uint32_t REMOTE_LOG_HASH(const char* str,uint32_t hash=2166136261u){
+    return *str?REMOTE_LOG_HASH(str+1,(hash^uint8_t(*str))*16777619u):hash;
+}
+
+//运行时计算格式ID,与REMOTE_LOG_HASH结果相同
+inline uint32_t remote_log_hash(const char* str,size_t len){
+    uint32_t hash=2166136261u;
+    for(size_t i=0;i<len;i++){
+        hash=(hash^uint8_t(str[i]))*16777619u;
+    }
+    return hash;
+}
+
+/*
+ * 参数编码: 类型标记(1字节) | 数值,小端
+ *   I32/U32/F32/PTR 4字节, I64/U64/F64 8字节, STR 长度(1字节)+内容(不含'\0')
+ * 只发送原始数值,格式化全部在接收端完成
+ */
+enum remote_log_tag_t:uint8_t{
+    REMOTE_LOG_I32=1,
+    REMOTE_LOG_U32,
+    REMOTE_LOG_I64,
+    REMOTE_LOG_U64,
+    REMOTE_LOG_F32,
+    REMOTE_LOG_F64,
+    REMOTE_LOG_STR,
+    REMOTE_LOG_PTR,
+};
+
+namespace remote_log_detail{
+
+//写入一个定长参数,放不下返回-1
+inline int put(uint8_t* out,int pos,int size,uint8_t tag,const void* value,int n){
+    if(pos<0||pos+1+n>size) return -1;
+    out[pos]=tag;
+    memcpy(out+pos+1,value,n);
+    return pos+1+n;
+}
+
+//整数,按宽度和符号选择标记,char/short/bool提升为32位
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value,int>::type
+encode_arg(uint8_t* out,int pos,int size,T value){
+    if(sizeof(T)<=4){
+        if(std::is_signed<T>::value){
+            int32_t v=int32_t(value);
+            return put(out,pos,size,REMOTE_LOG_I32,&v,4);
+        }
+        uint32_t v=uint32_t(value);
+        return put(out,pos,size,REMOTE_LOG_U32,&v,4);
+    }
+    if(std::is_signed<T>::value){
+        int64_t v=int64_t(value);
+        return put(out,pos,size,REMOTE_LOG_I64,&v,8);
+    }
+    uint64_t v=uint64_t(value);
+    return put(out,pos,size,REMOTE_LOG_U64,&v,8);
+}
+
+//枚举按整数发送
+template<typename T>
+typename std::enable_if<std::is_enum<T>::value,int>::type
+encode_arg(uint8_t* out,int pos,int size,T value){
+    return encode_arg(out,pos,size,int32_t(value));
+}
+
+inline int encode_arg(uint8_t* out,int pos,int size,float value){
+    return put(out,pos,size,REMOTE_LOG_F32,&value,4);
+}
+
+inline int encode_arg(uint8_t* out,int pos,int size,double value){
+#if REMOTE_LOG_DOUBLE_AS_FLOAT
+    return encode_arg(out,pos,size,float(value));
+#else
+    return put(out,pos,size,REMOTE_LOG_F64,&value,8);
+#endif
+}
+
+//字符串,只能用于%s,超过REMOTE_LOG_MAX_STRING的部分截断
+inline int encode_arg(uint8_t* out,int pos,int size,const char* value){
+    if(value==nullptr) value="(null)";
+    size_t n=strnlen(value,REMOTE_LOG_MAX_STRING);
+    if(pos<0||pos+2+int(n)>size) return -1;
+    out[pos]=REMOTE_LOG_STR;
+    out[pos+1]=uint8_t(n);
+    memcpy(out+pos+2,value,n);
+    return pos+2+int(n);
+}
+
+inline int encode_arg(uint8_t* out,int pos,int size,char* value){
+    return encode_arg(out,pos,size,(const char*)value);
+}
+
+//其他指针只发送地址
+template<typename T>
+int encode_arg(uint8_t* out,int pos,int size,T* value){
+    uint32_t v=uint32_t(uintptr_t(value));
+    return put(out,pos,size,REMOTE_LOG_PTR,&v,4);
+}
+
+inline int encode_args(uint8_t* out,int pos,int size){
+    return pos;
+}
+
+//依次编码参数,放不下时停止,返回已编码的位置,接收端缺少的参数显示为<?>
+template<typename T,typename... Args>
+int encode_args(uint8_t* out,int pos,int size,T first,Args... rest){
+    int next=encode_arg(out,pos,size,first);
+    if(next<0) return pos;
+    return encode_args(out,next,size,rest...);
+}
+
+//读出的一个参数
+struct arg_t{
+    uint8_t tag=0;
+    uint64_t bits=0;//整数和指针的原始值
+    double real=0;//浮点数
+    char str[REMOTE_LOG_MAX_STRING+1];
+};
+
+//读一个参数,数据不完整返回-1
+inline int read_arg(const uint8_t* args,int pos,int len,arg_t& arg){
+    if(pos>=len) return -1;
+    arg.tag=args[pos++];
+    switch(arg.tag){
+        case REMOTE_LOG_I32:case REMOTE_LOG_U32:case REMOTE_LOG_PTR:{
+            if(pos+4>len) return -1;
+            uint32_t v;
+            memcpy(&v,args+pos,4);
+            arg.bits=v;
+            return pos+4;
+        }
+        case REMOTE_LOG_I64:case REMOTE_LOG_U64:{
+            if(pos+8>len) return -1;
+            memcpy(&arg.bits,args+pos,8);
+            return pos+8;
+        }
+        case REMOTE_LOG_F32:{
+            if(pos+4>len) return -1;
+            float v;
+            memcpy(&v,args+pos,4);
+            arg.real=v;
+            return pos+4;
+        }
+        case REMOTE_LOG_F64:{
+            if(pos+8>len) return -1;
+            memcpy(&arg.real,args+pos,8);
+            return pos+8;
+        }
+        case REMOTE_LOG_STR:{
+            if(pos+1>len) return -1;
+            int n=args[pos++];
+            if(n>REMOTE_LOG_MAX_STRING||pos+n>len) return -1;
+            memcpy(arg.str,args+pos,n);
+            arg.str[n]='\0';
+            return pos+n;
+        }
+        default:
+            return -1;
+    }
+}
+
+//整数参数按发送端的宽度和本次转换的符号取值,与在发送端直接printf的结果一致
+inline int64_t arg_integer(const arg_t& arg,bool is_signed){
+    switch(arg.tag){
+        case REMOTE_LOG_I32:case REMOTE_LOG_U32:case REMOTE_LOG_PTR:
+            return is_signed?int64_t(int32_t(uint32_t(arg.bits))):int64_t(uint32_t(arg.bits));
+        case REMOTE_LOG_I64:case REMOTE_LOG_U64:
+            return int64_t(arg.bits);
+        case REMOTE_LOG_F32:case REMOTE_LOG_F64:
+            return int64_t(arg.real);
+        default:
+            return 0;
+    }
+}
+
+}//namespace remote_log_detail
+
+/**
+ * @brief 按格式串和二进制参数还原日志文本,格式串语法与printf相同
+ * @param fmt 格式串
+ * @param args 参数数据
+ * @param args_len 参数数据长度
+ * @param out 输出缓冲区
+ * @param out_size 输出缓冲区大小,结果总是以'\0'结尾
+ * @return 输出的字符数
+ * @note 长度修饰符(h,l,ll,z等)被忽略,按参数实际发送的宽度输出;参数缺少或类型不符时输出<?>
+ */
+inline int remote_log_format(const char* fmt,const uint8_t* args,int args_len,char* out,int out_size){
+    using namespace remote_log_detail;
+    if(out_size<=0) return 0;
+    int n=0;
+    int pos=0;
+    //追加snprintf的结果,超出缓冲区时截断
+    auto advance=[&](int written){
+        if(written<0) return;
+        n+=written;
+        if(n>out_size-1) n=out_size-1;
+    };
+    auto append=[&](const char* str){
+        while(*str&&n<out_size-1) out[n++]=*str++;
+    };
+    const char* p=fmt;
+    while(*p&&n<out_size-1){
+        if(*p!='%'){
+            out[n++]=*p++;
+            continue;
+        }
+        if(p[1]=='%'){
+            out[n++]='%';
+            p+=2;
+            continue;
+        }
+        //拆出标志,宽度和精度,*号从参数中读取;末尾留出 ll+转换符+'\0' 的位置,
+        //格式来自网络,放不下的转换不格式化,只跳过它的参数并输出<?>
+        char spec[32];
+        const int spec_max=int(sizeof(spec))-4;
+        int spec_len=0;
+        spec[spec_len++]=*p++;
+        bool bad=false;
+        bool too_long=false;
+        auto spec_push=[&](char c){
+            if(spec_len<spec_max) spec[spec_len++]=c;
+            else too_long=true;
+        };
+        while(*p&&strchr("-+ #0",*p)) spec_push(*p++);
+        for(int part=0;part<2;part++){
+            if(part==1){
+                if(*p!='.') break;
+                spec_push(*p++);
+            }
+            if(*p=='*'){
+                p++;
+                arg_t arg;
+                int next=read_arg(args,pos,args_len,arg);
+                if(next<0){
+                    bad=true;
+                }else{
+                    pos=next;
+                    char number[12];
+                    int len=snprintf(number,sizeof(number),"%d",int(arg_integer(arg,true)));
+                    for(int i=0;i<len;i++) spec_push(number[i]);
+                }
+            }else{
+                while(*p>='0'&&*p<='9') spec_push(*p++);
+            }
+        }
+        while(*p&&strchr("hlLqjzt",*p)) p++;
+        char conv=*p;
+        if(conv=='\0') break;
+        p++;
+        arg_t arg;
+        int next=bad?-1:read_arg(args,pos,args_len,arg);
+        if(next<0){
+            append("<?>");
+            pos=args_len;
+            continue;
+        }
+        if(too_long){
+            append("<?>");
+            pos=next;
+            continue;
+        }
+        pos=next;
+        if(strchr("diouxXc",conv)){
+            if(arg.tag==REMOTE_LOG_STR){
+                append("<?>");
+                continue;
+            }
+            bool is_signed=conv=='d'||conv=='i';
+            int64_t value=arg_integer(arg,is_signed);
+            if(conv=='c'){
+                spec[spec_len++]='c';
+                spec[spec_len]='\0';
+                advance(snprintf(out+n,out_size-n,spec,int(value)));
+            }else{
+                spec[spec_len++]='l';
+                spec[spec_len++]='l';
+                spec[spec_len++]=conv;
+                spec[spec_len]='\0';
+                if(is_signed) advance(snprintf(out+n,out_size-n,spec,(long long)value));
+                else advance(snprintf(out+n,out_size-n,spec,(unsigned long long)value));
+            }
+        }else if(strchr("fFeEgGaA",conv)){
+            if(arg.tag==REMOTE_LOG_STR){
+                append("<?>");
+                continue;
+            }
+            double value=(arg.tag==REMOTE_LOG_F32||arg.tag==REMOTE_LOG_F64)?arg.real:double(arg_integer(arg,arg.tag==REMOTE_LOG_I32||arg.tag==REMOTE_LOG_I64));
+            spec[spec_len++]=conv;
+            spec[spec_len]='\0';
+            advance(snprintf(out+n,out_size-n,spec,value));
+        }else if(conv=='s'){
+            if(arg.tag!=REMOTE_LOG_STR){
+                append("<?>");
+                continue;
+            }
+            spec[spec_len++]='s';
+            spec[spec_len]='\0';
+            advance(snprintf(out+n,out_size-n,spec,arg.str));
+        }else if(conv=='p'){
+            advance(snprintf(out+n,out_size-n,"0x%08x",unsigned(uint32_t(arg.bits))));
+        }else{
+            append("<?>");
+        }
+    }
+    out[n]='\0';
+    return n;
+}
+
+//一条日志记录,指针指向数据包
+struct remote_log_record_t{
+    uint32_t id;//格式ID
+    const uint8_t* args;//参数数据
+    uint8_t args_len;
+};
+
+/**
+ * @brief 编码一条记录: 格式ID(4字节,小端) | 参数长度(1字节) | 参数
+ * @param out 输出缓冲区
+ * @param size 输出缓冲区大小
+ * @return 记录长度,连记录头都放不下返回-1
+ */
+template<typename... Args>
+int remote_log_encode_record(uint8_t* out,int size,uint32_t id,Args... args){
+    if(size<REMOTE_LOG_RECORD_HEADER) return -1;
+    if(size>REMOTE_LOG_RECORD_HEADER+255) size=REMOTE_LOG_RECORD_HEADER+255;
+    memcpy(out,&id,4);
+    int len=remote_log_detail::encode_args(out,REMOTE_LOG_RECORD_HEADER,size,args...);
+    out[4]=uint8_t(len-REMOTE_LOG_RECORD_HEADER);
+    return len;
+}
+
+/**
+ * @brief 从数据包中解析一条记录,一个数据包中可以有多条记录
+ * @param data 数据包剩余数据
+ * @param len 剩余数据长度
+ * @param record 解析结果
+ * @return 本条记录的长度,数据不完整返回-1
+ */
+inline int remote_log_parse_record(const uint8_t* data,int len,remote_log_record_t& record){
+    if(len<REMOTE_LOG_RECORD_HEADER) return -1;
+    memcpy(&record.id,data,4);
+    record.args_len=data[4];
+    if(REMOTE_LOG_RECORD_HEADER+record.args_len>len) return -1;
+    record.args=data+REMOTE_LOG_RECORD_HEADER;
+    return REMOTE_LOG_RECORD_HEADER+record.args_len;
+}
+
+#endif
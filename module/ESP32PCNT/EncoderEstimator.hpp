@@ -0,0 +1,269 @@
+/*
+ * @Description: 编码器速度估计器,自适应窗口M/T法,边沿测周法和跟踪观测器,不依赖Arduino,可在主机上使用
+ * @Author: qingmeijiupiao
+ */
+#ifndef HXC_ENCODER_ESTIMATOR_HPP
+#define HXC_ENCODER_ESTIMATOR_HPP
+#include <stdint.h>
+
+//M/T法保存的计数变化记录条数,必须是2的幂
+#ifndef HXC_ENCODER_MT_HISTORY
+#define HXC_ENCODER_MT_HISTORY 32
+#endif
+
+//边沿测周法保存的边沿时间条数,必须是2的幂
+#ifndef HXC_ENCODER_EDGE_HISTORY
+#define HXC_ENCODER_EDGE_HISTORY 16
+#endif
+
+namespace HXC{
+
+/**
+ * @brief 自适应窗口M/T法测速
+ * @note  只记录计数发生变化的采样点(近似为边沿时刻),从最新的边沿向前找,
+ *        直到累计至少min_counts个脉冲或超出最大窗口,用两个边沿之间的脉冲数除以时间。
+ *        高速时窗口自动缩短到几个采样周期,低速时窗口拉长,不会量化成采样频率的整数倍
+ */
+class MTSpeedEstimator{
+    public:
+        /**
+         * @param _min_counts 窗口内至少累计的脉冲数,越大越平滑,延迟越大
+         * @param _max_window_us 最大窗口长度,单位us,超过该时间没有脉冲认为速度为0
+         */
+        MTSpeedEstimator(int32_t _min_counts=8,int64_t _max_window_us=100000)
+        :min_counts(_min_counts),max_window_us(_max_window_us){}
+
+        void set_param(int32_t _min_counts,int64_t _max_window_us){
+            min_counts=_min_counts>0?_min_counts:1;
+            max_window_us=_max_window_us;
+        }
+
+        /**
+         * @brief 输入一次采样
+         * @param count 当前计数
+         * @param time_us 采样时间,单位us
+         * @return 速度,单位Hz(脉冲每秒)
+         */
+        float update(int64_t count,int64_t time_us){
+            if(history_num==0||count!=history[newest()].count){
+                history[history_head]={count,time_us};
+                history_head=(history_head+1)&(HXC_ENCODER_MT_HISTORY-1);
+                if(history_num<HXC_ENCODER_MT_HISTORY) history_num++;
+                if(history_num==1) return speed;//第一个采样点只作为起点
+            }
+            const sample_t& last=history[newest()];
+            int64_t idle_us=time_us-last.time_us;
+            if(idle_us>=max_window_us){
+                speed=0;
+                return speed;
+            }
+            //从最新边沿向前找窗口起点
+            int start=-1;
+            for(int i=1;i<history_num;i++){
+                const sample_t& s=history[(newest()-i)&(HXC_ENCODER_MT_HISTORY-1)];
+                if(time_us-s.time_us>max_window_us) break;
+                start=(newest()-i)&(HXC_ENCODER_MT_HISTORY-1);
+                int64_t n=last.count-s.count;
+                if(n>=min_counts||n<=-min_counts) break;
+            }
+            if(start>=0){
+                const sample_t& s=history[start];
+                speed=float(last.count-s.count)*1000000.f/float(last.time_us-s.time_us);
+            }
+            //距上一个边沿的时间已经超过当前速度对应的脉冲周期,说明正在减速,速度不可能大于1/idle
+            if(idle_us>0){
+                float bound=1000000.f/float(idle_us);
+                if(speed>bound) speed=bound;
+                else if(speed<-bound) speed=-bound;
+            }
+            return speed;
+        }
+
+        float get_speed(){return speed;}
+
+        void reset(){
+            history_head=0;
+            history_num=0;
+            speed=0;
+        }
+
+    protected:
+        struct sample_t{
+            int64_t count;
+            int64_t time_us;
+        };
+        int newest(){return (history_head-1)&(HXC_ENCODER_MT_HISTORY-1);}
+        sample_t history[HXC_ENCODER_MT_HISTORY];
+        int history_head=0;
+        int history_num=0;
+        int32_t min_counts;
+        int64_t max_window_us;
+        float speed=0;
+};
+
+/**
+ * @brief 边沿测周法测速,用单个边沿的时间戳计算速度
+ * @note  用最近edges个边沿间隔的总时间计算速度,4倍频时取4个边沿即一个完整的AB周期,
+ *        可以抵消AB相占空比和相位误差。方向改变时清空历史,
+ *        距上一个边沿的时间超过当前边沿间隔时速度按1/空闲时间衰减,超过timeout认为静止
+ */
+class EdgePeriodEstimator{
+    public:
+        /**
+         * @param _edges 参与计算的边沿间隔数,不超过HXC_ENCODER_EDGE_HISTORY-1
+         * @param _timeout_us 超过该时间没有边沿认为速度为0,单位us
+         */
+        EdgePeriodEstimator(int _edges=4,int64_t _timeout_us=500000){
+            set_param(_edges,_timeout_us);
+        }
+
+        void set_param(int _edges,int64_t _timeout_us){
+            if(_edges<1) _edges=1;
+            if(_edges>HXC_ENCODER_EDGE_HISTORY-1) _edges=HXC_ENCODER_EDGE_HISTORY-1;
+            edges=_edges;
+            timeout_us=_timeout_us;
+        }
+
+        /**
+         * @brief 输入一个边沿
+         * @param time_us 边沿时间,单位us
+         * @param dir 方向,+1或-1
+         */
+        void add_edge(int64_t time_us,int8_t dir){
+            if(dir==0) return;
+            if(dir!=last_dir){
+                //方向改变,之前的边沿间隔不能用于计算
+                last_dir=dir;
+                edge_num=0;
+                period_speed=0;
+            }
+            times[head]=time_us;
+            head=(head+1)&(HXC_ENCODER_EDGE_HISTORY-1);
+            if(edge_num<HXC_ENCODER_EDGE_HISTORY) edge_num++;
+            //边沿不足时用已有的间隔
+            int n=edge_num-1<edges?edge_num-1:edges;
+            if(n>0){
+                int64_t span=time_us-times[(head-1-n)&(HXC_ENCODER_EDGE_HISTORY-1)];
+                if(span>0) period_speed=float(dir)*float(n)*1000000.f/float(span);
+            }
+            last_edge_us=time_us;
+        }
+
+        /**
+         * @brief 计算当前速度
+         * @param now_us 当前时间,单位us
+         * @return 速度,单位Hz(边沿每秒)
+         */
+        float update(int64_t now_us){
+            int64_t idle_us=now_us-last_edge_us;
+            if(edge_num==0||idle_us>=timeout_us){
+                speed=0;
+                return speed;
+            }
+            speed=period_speed;
+            if(idle_us>0){
+                float bound=1000000.f/float(idle_us);
+                if(speed>bound) speed=bound;
+                else if(speed<-bound) speed=-bound;
+            }
+            return speed;
+        }
+
+        float get_speed(){return speed;}
+
+        void reset(){
+            head=0;
+            edge_num=0;
+            last_dir=0;
+            period_speed=0;
+            speed=0;
+        }
+
+    protected:
+        int64_t times[HXC_ENCODER_EDGE_HISTORY];
+        int head=0;
+        int edge_num=0;
+        int8_t last_dir=0;
+        int64_t last_edge_us=0;
+        int edges;
+        int64_t timeout_us;
+        float period_speed=0;
+        float speed=0;
+};
+
+/**
+ * @brief 三阶跟踪观测器(PLL型),输出平滑的位置,速度,加速度
+ * @note  以测量计数与估计位置的误差驱动位置/速度/加速度三个积分器,
+ *        三个极点都放在-bandwidth处:k1=3w,k2=3w^2,k3=w^3,
+ *        带宽越高响应越快噪声越大,一般取采样频率的1/20以下
+ */
+class TrackingObserver{
+    public:
+        /**
+         * @param bandwidth_hz 观测器带宽,单位Hz
+         */
+        TrackingObserver(float bandwidth_hz=50.f){
+            set_bandwidth(bandwidth_hz);
+        }
+
+        void set_bandwidth(float bandwidth_hz){
+            float w=2.f*3.14159265f*bandwidth_hz;
+            k1=3.f*w;
+            k2=3.f*w*w;
+            k3=w*w*w;
+        }
+
+        /**
+         * @brief 输入一次采样
+         * @param count 当前计数
+         * @param time_us 采样时间,单位us
+         * @return 速度,单位Hz(脉冲每秒)
+         */
+        float update(int64_t count,int64_t time_us){
+            if(!started){
+                started=true;
+                position=double(count);
+                velocity=0;
+                acceleration=0;
+                last_time_us=time_us;
+                return velocity;
+            }
+            float dt=float(time_us-last_time_us)*1e-6f;
+            last_time_us=time_us;
+            if(dt<=0) return velocity;
+            //预测
+            position+=double(velocity*dt+0.5f*acceleration*dt*dt);
+            velocity+=acceleration*dt;
+            //校正,误差在double下计算,长时间运行计数很大也不丢精度
+            float error=float(double(count)-position);
+            position+=double(k1*error*dt);
+            velocity+=k2*error*dt;
+            acceleration+=k3*error*dt;
+            return velocity;
+        }
+
+        //估计位置,单位脉冲
+        double get_position(){return position;}
+        //估计速度,单位Hz
+        float get_speed(){return velocity;}
+        //估计加速度,单位Hz/s
+        float get_acceleration(){return acceleration;}
+
+        void reset(){
+            started=false;
+            position=0;
+            velocity=0;
+            acceleration=0;
+        }
+
+    protected:
+        float k1,k2,k3;
+        bool started=false;
+        double position=0;
+        float velocity=0;
+        float acceleration=0;
+        int64_t last_time_us=0;
+};
+
+}
+#endif
@@ -3,16 +3,69 @@
  * @Description: 使用PCNT外设实现的编码器库
  * @Author: qingmeijiupiao
  * @LastEditTime: 2025-01-30 02:11:07
+ * @relay: HXC_std_err_def
  */
 #ifndef HXCPCNTENCODER_HPP
 #define HXCPCNTENCODER_HPP
 #include <Arduino.h>
 #include "driver/pcnt.h"
+#include "driver/gpio.h"
+#include "hal/gpio_ll.h"
+#include "soc/gpio_struct.h"
+#include "soc/soc_caps.h"
+#include "soc/pcnt_struct.h"
+#include <functional>
+#include <atomic>
+#include "freertos/semphr.h"
+#include "EncoderEstimator.hpp"
+#include <HXC_std_err_def.h>
+
+//PCNT计数上下限,计数到达上下限时硬件清零并触发中断,由中断累加到64位计数
+#define HXC_ENCODER_PCNT_LIMIT 32767
+
+//可用的PCNT单元数量,ESP32为8个,S2/S3为4个
+#ifndef HXC_ENCODER_PCNT_UNITS
+#if defined(SOC_PCNT_UNITS_PER_GROUP)
+#define HXC_ENCODER_PCNT_UNITS SOC_PCNT_UNITS_PER_GROUP
+#elif defined(SOC_PCNT_UNIT_NUM)
+#define HXC_ENCODER_PCNT_UNITS SOC_PCNT_UNIT_NUM
+#else
+#define HXC_ENCODER_PCNT_UNITS PCNT_UNIT_MAX
+#endif
+#endif
+
+//边沿捕获环形缓冲区长度,必须是2的幂,采样周期内的边沿数超过该值时丢弃
+#ifndef HXC_ENCODER_EDGE_RING
+#define HXC_ENCODER_EDGE_RING 64
+#endif
+
+//共享采样任务最多管理的编码器数量
+#ifndef HXC_ENCODER_MAX
+#define HXC_ENCODER_MAX 16
+#endif
+
 namespace HXC{
 
+//测速方法
+enum encoder_speed_mode_t{
+    ENCODER_SPEED_DELTA=0,//相邻两次采样的差分,高速时准确,低速时量化严重
+    ENCODER_SPEED_MT=1,//自适应窗口M/T法,低速也能得到连续的速度
+    ENCODER_SPEED_OBSERVER=2,//跟踪观测器,输出平滑的位置/速度/加速度
+    ENCODER_SPEED_EDGE=3//边沿测周法,GPIO中断记录每个边沿的时间戳,适合极低转速
+};
+
+//计数后端
+enum encoder_backend_t{
+    ENCODER_BACKEND_PCNT=0,//PCNT硬件计数
+    ENCODER_BACKEND_GPIO=1//PCNT单元用完后退回GPIO中断解码
+};
+
 /**
  * @brief : 使用ESP32的PCNT外设实现的编码器计数器,4倍采样
- * @note  : 相比中断计数cpu资源占用低,由于PCNT最大计数限制32767,内部使用一个任务来轮询PCNT,因此可以实现更高的计数
+ * @note  : 相比中断计数cpu资源占用低,PCNT计数到达±32767时触发上下限中断累加溢出次数,
+ *          读取时补上还没处理的溢出中断,因此任意转速下位置计数都是准确的。所有编码器共用一个采样任务测速,
+ *          同一时刻连续读取全部编码器,得到时间一致的多轮速度。
+ *          PCNT单元用完后自动退回GPIO中断解码,接口不变,但每个边沿都会进一次中断
  * @return  {*}
  * @Author : qingmeijiupiao
  */
@@ -24,65 +77,101 @@ class Encoder{
          * @param _PINB  编码器B相的脉冲信号GPIO
          */
         Encoder(uint8_t _PINA,uint8_t _PINB):PINA(_PINA),PINB(_PINB){
-            unit=used_unit++;//自动分配PCNT单元
+            unit=alloc_unit();//自动分配PCNT单元,用完后为-1,使用GPIO中断解码
+            if(unit<0){
+                log_w("HXC::Encoder: PCNT units used up, pin %d/%d uses GPIO interrupt",PINA,PINB);
+            }
         };
         //禁止复制
         Encoder(Encoder&)=delete;
         //禁止赋值传递
         Encoder& operator=(Encoder&)=delete;
         ~Encoder(){
-            vTaskDelete(counter_loop_handle);
+            remove_from_sampler(this);
+            if(is_setup&&unit>=0){
+                pcnt_intr_disable(static_cast<pcnt_unit_t>(unit));
+                pcnt_instances[unit]=nullptr;
+            }
+            if(gpio_isr_added){
+                gpio_isr_handler_remove(static_cast<gpio_num_t>(PINA));
+                gpio_isr_handler_remove(static_cast<gpio_num_t>(PINB));
+            }
+            free_unit(unit);
+            free(edge_ring);
         }
         /**
          * @brief 初始化
-         * @param frc  多圈计数器和速度检测的频率
+         * @param frc  速度检测的频率,为0时不参与测速,只计数
+         * @note  所有编码器共用一个采样任务,采样频率取所有编码器中最高的frc
          */
         void setup(int frc=1000){
-            LOOPFREQ=frc;
-            this->pcnt_config= pcnt_config_t{
-                        .pulse_gpio_num = static_cast<gpio_num_t>(PINA),  // 编码器A相连接的GPIO
-                        .ctrl_gpio_num = static_cast<gpio_num_t>(PINB),   // 编码器B相连接的GPIO
-                        .lctrl_mode = PCNT_MODE_REVERSE, // 控制信号低电平时反转计数方向
-                        .hctrl_mode = PCNT_MODE_KEEP,    // 控制信号高电平时保持计数模式不变
-                        .pos_mode = PCNT_COUNT_DEC,      // 正边沿计数增加
-                        .neg_mode = PCNT_COUNT_INC,      // 负边沿计数保持不变
-                        .counter_h_lim = 32767,          // 最大计数限制
-                        .counter_l_lim = 0,              // 最小计数限制
-                        .unit = static_cast<pcnt_unit_t>(unit),             // PCNT单元编号
-                        .channel =static_cast<pcnt_channel_t>(unit),       // PCNT通道编号
-            };
-            
-            pcnt_unit_config(&pcnt_config);
-            // 重新配置结构体，用于第二个通道
-            pcnt_config.pulse_gpio_num = static_cast<gpio_num_t>(PINB);  // 现在脉冲输入是编码器B相
-            pcnt_config.ctrl_gpio_num = static_cast<gpio_num_t>(PINA);   // 控制输入是编码器A相
-            pcnt_config.pos_mode = PCNT_COUNT_INC;
-            pcnt_config.neg_mode = PCNT_COUNT_DEC;
-            pcnt_config.channel = PCNT_CHANNEL_1; // 使用通道1
-            pcnt_unit_config(&pcnt_config);
-            pcnt_counter_clear(pcnt_config.unit);
-            if(counter_loop_handle==nullptr){
-                xTaskCreate(counter_loop, "counter_loop", 1024, this, 5, &counter_loop_handle);               
+            if(unit>=0){
+                setup_pcnt();
+            }
+            //GPIO后端或开启了边沿捕获时需要GPIO中断
+            if(unit<0||edge_ring!=nullptr){
+                setup_gpio();
             }
+            is_setup=true;
 
+            if(frc>0){
+                add_to_sampler(this,frc);
+            }
         };
 
         /**
          * @brief 设置脉冲去抖动滤波器的时间常数
          * @param ns  宽度小于该值的脉冲将被忽略，单位为纳秒
+         * @note  GPIO中断后端没有硬件滤波,设置无效
          */
         void set_filter(uint16_t ns){
+            if(unit<0) return;
             pcnt_filter_enable(static_cast<pcnt_unit_t>(unit));
             pcnt_set_filter_value(static_cast<pcnt_unit_t>(unit),ns);
         }
 
+        //获取计数后端
+        encoder_backend_t get_backend(){
+            return unit>=0?ENCODER_BACKEND_PCNT:ENCODER_BACKEND_GPIO;
+        }
+
+        /**
+         * @brief 每个边沿GPIO中断的平均耗时(GPIO后端或边沿捕获)
+         * @return 平均耗时,单位CPU周期,未使用GPIO中断时为0
+         */
+        uint32_t get_isr_cycles_avg(){
+            uint32_t edges=isr_edges;
+            return edges?uint32_t(isr_cycles_sum/edges):0;
+        }
+
+        /**
+         * @brief 估算在给定边沿频率下本编码器占用的CPU比例
+         * @param edge_rate 每秒边沿数(A,B两相合计,即4倍频后的计数频率)
+         * @return CPU占用比例,0-1,未使用GPIO中断时为0
+         * @note  只统计中断函数本身,不含中断进入/退出的开销,实际占用略高
+         */
+        float get_cpu_load(float edge_rate){
+            return float(get_isr_cycles_avg())*edge_rate/(cycle_per_us()*1e6f);
+        }
+
+        //GPIO中断后端检测到的非法跳变次数(AB同时变化),通常说明边沿丢失或信号有毛刺
+        uint32_t get_error_count(){
+            return error_count;
+        }
+
+        //清空中断耗时统计
+        void reset_isr_stats(){
+            isr_cycles_sum=0;
+            isr_edges=0;
+            error_count=0;
+        }
 
         /**
          * @brief 获取计数器的当前计数
          * @return 计数器的当前计数
          */
         int64_t get_count(){
-            return count;
+            return get_total_count()+count_offset;
         };
 
 
@@ -94,15 +183,194 @@ class Encoder{
             return speed;
         };
 
+        /**
+         * @brief 设置测速方法
+         * @param mode 测速方法,见encoder_speed_mode_t
+         */
+        void set_speed_mode(encoder_speed_mode_t mode){
+            if(mode==ENCODER_SPEED_EDGE&&edge_ring==nullptr){
+                //边沿捕获缓冲区只在使用时分配
+                edge_ring=(edge_t*)malloc(sizeof(edge_t)*HXC_ENCODER_EDGE_RING);
+                if(edge_ring==nullptr){
+                    log_e("HXC::Encoder: edge ring alloc failed");
+                    return;
+                }
+                if(is_setup) setup_gpio();
+            }
+            xSemaphoreTake(estimator_mutex(),portMAX_DELAY);
+            speed_mode=mode;
+            mt_estimator.reset();
+            observer.reset();
+            edge_estimator.reset();
+            edge_tail.store(edge_head.load());
+            xSemaphoreGive(estimator_mutex());
+        }
+
+        /**
+         * @brief 设置边沿测周法参数
+         * @param edges 参与计算的边沿间隔数,4倍频时取4即一个完整AB周期
+         * @param timeout_us 超过该时间没有边沿速度为0,单位us
+         */
+        void set_edge_param(int edges,int64_t timeout_us){
+            xSemaphoreTake(estimator_mutex(),portMAX_DELAY);
+            edge_estimator.set_param(edges,timeout_us);
+            xSemaphoreGive(estimator_mutex());
+        }
+
+        //边沿捕获缓冲区满丢弃的边沿数
+        uint32_t get_edge_dropped(){
+            return edge_dropped;
+        }
+
+        /**
+         * @brief 设置M/T法参数
+         * @param min_counts 窗口内至少累计的脉冲数
+         * @param max_window_us 最大窗口长度,单位us,超过该时间没有脉冲速度为0
+         */
+        void set_mt_param(int32_t min_counts,int64_t max_window_us){
+            xSemaphoreTake(estimator_mutex(),portMAX_DELAY);
+            mt_estimator.set_param(min_counts,max_window_us);
+            xSemaphoreGive(estimator_mutex());
+        }
+
+        /**
+         * @brief 设置跟踪观测器带宽
+         * @param bandwidth_hz 带宽,单位Hz,一般取采样频率的1/20以下
+         */
+        void set_observer_bandwidth(float bandwidth_hz){
+            xSemaphoreTake(estimator_mutex(),portMAX_DELAY);
+            observer.set_bandwidth(bandwidth_hz);
+            xSemaphoreGive(estimator_mutex());
+        }
+
+        /**
+         * @brief 获取跟踪观测器估计的加速度,仅ENCODER_SPEED_OBSERVER模式有效
+         * @return 加速度,单位Hz/s
+         */
+        float get_acceleration(){
+            xSemaphoreTake(estimator_mutex(),portMAX_DELAY);
+            float acceleration=observer.get_acceleration();
+            xSemaphoreGive(estimator_mutex());
+            return acceleration;
+        }
+
+        /**
+         * @brief 获取跟踪观测器估计的平滑位置,仅ENCODER_SPEED_OBSERVER模式有效
+         * @return 位置,单位脉冲,已加上reset_count的偏移
+         */
+        double get_observer_position(){
+            xSemaphoreTake(estimator_mutex(),portMAX_DELAY);
+            double position=observer.get_position();
+            xSemaphoreGive(estimator_mutex());
+            return position+double(count_offset);
+        }
+
         /**
          * @brief 将计数器重置为指定的值。
          * 
          * @param _count 要重置的值，缺省为0。
          */
         void reset_count(int64_t _count=0){
-            count=_count;
+            count_offset=_count-get_total_count();
         };
+
+        /**
+         * @brief 获取最近一次共享采样时的计数,所有编码器在同一时刻采样
+         * @return 采样时的计数
+         */
+        int64_t get_sample_count(){
+            return sample_count+count_offset;
+        }
+
+        /**
+         * @brief 获取最近一次共享采样的时间戳,所有编码器共用
+         * @return 采样时间,单位us
+         */
+        static int64_t get_sample_time_us(){
+            return sample_time_us;
+        }
+
+        /**
+         * @brief 设置采样回调,每轮采样完全部编码器后在采样任务中调用,可用于底盘里程计
+         * @param func 回调函数,参数为本轮采样时间(us),传入nullptr取消
+         */
+        static void set_sample_callback(std::function<void(int64_t)> func){
+            sample_callback=func;
+        }
     protected:
+        //PCNT后端初始化
+        void setup_pcnt(){
+            this->pcnt_config= pcnt_config_t{
+                        .pulse_gpio_num = static_cast<gpio_num_t>(PINA),  // 编码器A相连接的GPIO
+                        .ctrl_gpio_num = static_cast<gpio_num_t>(PINB),   // 编码器B相连接的GPIO
+                        .lctrl_mode = PCNT_MODE_REVERSE, // 控制信号低电平时反转计数方向
+                        .hctrl_mode = PCNT_MODE_KEEP,    // 控制信号高电平时保持计数模式不变
+                        .pos_mode = PCNT_COUNT_DEC,      // 正边沿计数增加
+                        .neg_mode = PCNT_COUNT_INC,      // 负边沿计数保持不变
+                        .counter_h_lim = HXC_ENCODER_PCNT_LIMIT,   // 最大计数限制
+                        .counter_l_lim = -HXC_ENCODER_PCNT_LIMIT,  // 最小计数限制
+                        .unit = static_cast<pcnt_unit_t>(unit),    // PCNT单元编号
+                        .channel = PCNT_CHANNEL_0,                 // 使用通道0
+            };
+            
+            pcnt_unit_config(&pcnt_config);
+            // 重新配置结构体，用于第二个通道
+            pcnt_config.pulse_gpio_num = static_cast<gpio_num_t>(PINB);  // 现在脉冲输入是编码器B相
+            pcnt_config.ctrl_gpio_num = static_cast<gpio_num_t>(PINA);   // 控制输入是编码器A相
+            pcnt_config.pos_mode = PCNT_COUNT_INC;
+            pcnt_config.neg_mode = PCNT_COUNT_DEC;
+            pcnt_config.channel = PCNT_CHANNEL_1; // 使用通道1
+            pcnt_unit_config(&pcnt_config);
+
+            //计数到达上下限时触发中断
+            pcnt_counter_pause(pcnt_config.unit);
+            pcnt_event_enable(pcnt_config.unit,PCNT_EVT_H_LIM);
+            pcnt_event_enable(pcnt_config.unit,PCNT_EVT_L_LIM);
+            pcnt_counter_clear(pcnt_config.unit);
+            //不使用IDF的中断服务:它先清中断标志再调用回调,读数可能落在两者之间
+            if(pcnt_isr_handle==nullptr){
+                if(pcnt_isr_register(pcnt_isr,nullptr,0,&pcnt_isr_handle)!=ESP_OK){
+                    log_e("HXC::Encoder: pcnt isr register failed");
+                }
+            }
+            if(!is_setup){
+                pcnt_instances[unit]=this;
+                pcnt_intr_enable(pcnt_config.unit);
+            }
+            pcnt_counter_resume(pcnt_config.unit);
+        }
+
+        //GPIO中断初始化,A,B两相双边沿中断,用于GPIO后端计数和边沿捕获
+        void setup_gpio(){
+            if(gpio_isr_added) return;
+            if(unit>=0){
+                //PCNT后端只打开引脚中断,不改变引脚配置
+                gpio_set_intr_type(static_cast<gpio_num_t>(PINA),GPIO_INTR_ANYEDGE);
+                gpio_set_intr_type(static_cast<gpio_num_t>(PINB),GPIO_INTR_ANYEDGE);
+            }else{
+                gpio_config_t io_config={};
+                io_config.pin_bit_mask=(1ULL<<PINA)|(1ULL<<PINB);
+                io_config.mode=GPIO_MODE_INPUT;
+                io_config.pull_up_en=GPIO_PULLUP_ENABLE;
+                io_config.pull_down_en=GPIO_PULLDOWN_DISABLE;
+                io_config.intr_type=GPIO_INTR_ANYEDGE;
+                gpio_config(&io_config);
+            }
+            gpio_state=read_ab();
+            //Arduino的attachInterrupt可能已经安装过,返回ESP_ERR_INVALID_STATE
+            esp_err_t err=gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+            if(err!=ESP_OK&&err!=ESP_ERR_INVALID_STATE){
+                log_e("HXC::Encoder: gpio isr service install failed");
+                return;
+            }
+            gpio_isr_handler_add(static_cast<gpio_num_t>(PINA),gpio_isr,this);
+            gpio_isr_handler_add(static_cast<gpio_num_t>(PINB),gpio_isr,this);
+            gpio_intr_enable(static_cast<gpio_num_t>(PINA));
+            gpio_intr_enable(static_cast<gpio_num_t>(PINB));
+            gpio_isr_added=true;
+        }
+
+
         /**
          * @brief 直接从PCNT单元获取当前计数，未经任何处理。
          * @return 当前计数，作为一个有符号的16位整数。
@@ -110,53 +378,305 @@ class Encoder{
          */
 
         int16_t get_count_row(){
+            if(unit<0) return gpio_count;
             int16_t count;
             pcnt_get_counter_value(static_cast<pcnt_unit_t>(unit),&count);
             return count;
         }
 
-        //循环计数线程
-        static void counter_loop(void* param){
+        /**
+         * @brief 上电以来的总计数,溢出次数*上限+PCNT当前计数
+         * @note  计数到达上下限时硬件先清零,中断随后才累加溢出次数。中断在count_lock内累加溢出次数并清除中断标志,
+         *        读取时持有同一把锁,因此未处理的上下限中断一定还能在中断标志中看到,有则按事件方向补上
+         */
+        int64_t get_total_count(){
+            int64_t total;
+            portENTER_CRITICAL(&count_lock);
+            while(1){
+                int32_t overflow=overflow_count;
+                bool pending=limit_pending();
+                int16_t row=get_count_row();
+                //读取期间硬件到达上下限,重新读取
+                if(pending!=limit_pending()) continue;
+                if(pending) overflow+=limit_direction();
+                total=int64_t(overflow)*HXC_ENCODER_PCNT_LIMIT+row;
+                break;
+            }
+            portEXIT_CRITICAL(&count_lock);
+            return total;
+        }
+
+        //PCNT单元是否有还没处理的上下限中断
+        bool limit_pending(){
+            return unit>=0&&(PCNT.int_raw.val&(1u<<unit));
+        }
+
+        //未处理的上下限事件对溢出次数的修正,上限+1下限-1
+        int32_t limit_direction(){
+            uint32_t status=0;
+            pcnt_get_event_status(static_cast<pcnt_unit_t>(unit),&status);
+            if(status&PCNT_EVT_H_LIM) return 1;
+            if(status&PCNT_EVT_L_LIM) return -1;
+            return 0;
+        }
+
+        //PCNT上下限中断,计数器已被硬件清零,在count_lock内累加溢出次数并清除中断标志
+        static void pcnt_isr(void* param){
+            uint32_t status=PCNT.int_st.val;
+            for(int i=0;i<HXC_ENCODER_PCNT_UNITS;i++){
+                uint32_t bit=1u<<i;
+                if(!(status&bit)) continue;
+                HXC::Encoder *instance=pcnt_instances[i];
+                if(instance==nullptr){
+                    PCNT.int_clr.val=bit;
+                    continue;
+                }
+                portENTER_CRITICAL_ISR(&instance->count_lock);
+                instance->overflow_count+=instance->limit_direction();
+                PCNT.int_clr.val=bit;
+                portEXIT_CRITICAL_ISR(&instance->count_lock);
+            }
+        }
+
+        //读取AB相电平,bit1为A相,bit0为B相
+        inline uint8_t IRAM_ATTR read_ab(){
+            return (gpio_ll_get_level(&GPIO,static_cast<gpio_num_t>(PINA))<<1)
+                  |gpio_ll_get_level(&GPIO,static_cast<gpio_num_t>(PINB));
+        }
+
+        /**
+         * @brief GPIO中断解码,查表得到每次跳变的计数方向
+         * @note  与PCNT后端方向一致,计数到达上下限时同样清零并累加溢出次数,
+         *        因此get_total_count对两种后端通用。开启边沿捕获时记录每个边沿的时间戳,
+         *        时间戳使用esp_timer而不是CPU周期计数,两个核的周期计数不同步
+         */
+        static void IRAM_ATTR gpio_isr(void* param){
             HXC::Encoder *instance=static_cast<HXC::Encoder*>(param);
-            instance->last_time=micros();
+            uint32_t start=now_cycle();
+            uint8_t state=instance->read_ab();
+            int8_t step=quadrature_table[(instance->gpio_state<<2)|state];
+            //电平未变(毛刺)或AB同时变化(丢边沿)时查表为0
+            if(step==0&&state!=instance->gpio_state){
+                instance->error_count++;
+            }
+            instance->gpio_state=state;
+            if(instance->unit<0){
+                //与get_total_count互斥,清零和累加溢出次数对读取方是原子的
+                portENTER_CRITICAL_ISR(&instance->count_lock);
+                int16_t count=instance->gpio_count+step;
+                if(count>=HXC_ENCODER_PCNT_LIMIT){
+                    instance->overflow_count++;
+                    count=0;
+                }else if(count<=-HXC_ENCODER_PCNT_LIMIT){
+                    instance->overflow_count--;
+                    count=0;
+                }
+                instance->gpio_count=count;
+                portEXIT_CRITICAL_ISR(&instance->count_lock);
+            }
+            if(step!=0&&instance->edge_ring!=nullptr){
+                uint32_t head=instance->edge_head.load(std::memory_order_relaxed);
+                if(head-instance->edge_tail.load(std::memory_order_acquire)<HXC_ENCODER_EDGE_RING){
+                    edge_t& edge=instance->edge_ring[head&(HXC_ENCODER_EDGE_RING-1)];
+                    edge.time_us=now_time_us();
+                    edge.dir=step;
+                    instance->edge_head.store(head+1,std::memory_order_release);
+                }else{
+                    instance->edge_dropped++;
+                }
+            }
+            instance->isr_cycles_sum+=now_cycle()-start;
+            instance->isr_edges++;
+        }
+
+        //分配空闲的PCNT单元,没有空闲单元返回-1
+        static int8_t alloc_unit(){
+            int8_t result=-1;
+            portENTER_CRITICAL(&sampler_lock);
+            for(int i=0;i<HXC_ENCODER_PCNT_UNITS;i++){
+                if(!(used_unit_mask&(1u<<i))){
+                    used_unit_mask|=1u<<i;
+                    result=i;
+                    break;
+                }
+            }
+            portEXIT_CRITICAL(&sampler_lock);
+            return result;
+        }
+
+        //释放PCNT单元
+        static void free_unit(int8_t _unit){
+            if(_unit<0) return;
+            portENTER_CRITICAL(&sampler_lock);
+            used_unit_mask&=~(1u<<_unit);
+            portEXIT_CRITICAL(&sampler_lock);
+        }
+
+        //注册到共享采样任务
+        static void add_to_sampler(Encoder* encoder,int frc){
+            bool added=false;
+            portENTER_CRITICAL(&sampler_lock);
+            for(int i=0;i<instance_num;i++){
+                if(instances[i]==encoder) added=true;//重复setup
+            }
+            if(!added&&instance_num<HXC_ENCODER_MAX){
+                encoder->sample_count=encoder->get_total_count();
+                encoder->last_count=encoder->sample_count;
+                encoder->last_time=now_time_us();
+                instances[instance_num++]=encoder;
+                added=true;
+            }
+            if(frc>LOOPFREQ) LOOPFREQ=frc;
+            portEXIT_CRITICAL(&sampler_lock);
+            if(!added){
+                log_e("HXC::Encoder: more than %d encoders, speed disabled",HXC_ENCODER_MAX);
+                return;
+            }
+            if(sampler_handle==nullptr){
+                xTaskCreate(sampler_loop,"encoder_sampler",2048,nullptr,5,&sampler_handle);
+            }
+        }
+
+        //从共享采样任务移除,持有估计器锁,返回后采样任务不会再访问该编码器
+        static void remove_from_sampler(Encoder* encoder){
+            xSemaphoreTake(estimator_mutex(),portMAX_DELAY);
+            portENTER_CRITICAL(&sampler_lock);
+            for(int i=0;i<instance_num;i++){
+                if(instances[i]==encoder){
+                    instances[i]=instances[--instance_num];
+                    break;
+                }
+            }
+            portEXIT_CRITICAL(&sampler_lock);
+            xSemaphoreGive(estimator_mutex());
+        }
+
+        /**
+         * @brief 估计器锁,保护测速方法和估计器状态
+         * @note  估计器的浮点运算和边沿处理耗时较长,用互斥量而不是关中断的临界区,不会阻塞编码器自身的中断
+         */
+        static SemaphoreHandle_t estimator_mutex(){
+            //局部静态变量保证只创建一次
+            static SemaphoreHandle_t handle=xSemaphoreCreateMutex();
+            return handle;
+        }
+
+        //共享采样线程,同一时刻连续读取所有编码器
+        static void sampler_loop(void* param){
             auto time=xTaskGetTickCount();
             while(1){
-                int now_count=instance->get_count_row();
-                int now_time=micros();
-                //计算增量
-                int delta=now_count-instance->last_count_row;
-                //超过PCNT最大计数限制,计算正反转
-                if(abs(delta)>32767/2){
-                    if(delta>0){
-                        delta-=32767;
-                    }else{
-                        delta+=32767;
+                //延时
+                vTaskDelayUntil(&time,LOOPFREQ>=1000?1:1000/LOOPFREQ);//延时控制频率
+                //持有估计器锁期间编码器不会被移除,速度计算在临界区外进行
+                xSemaphoreTake(estimator_mutex(),portMAX_DELAY);
+                //临界区内只连续读取全部PCNT,保证采样时刻一致
+                portENTER_CRITICAL(&sampler_lock);
+                int64_t now_time=now_time_us();
+                int num=instance_num;
+                for(int i=0;i<num;i++){
+                    instances[i]->sample_count=instances[i]->get_total_count();
+                }
+                sample_time_us=now_time;
+                portEXIT_CRITICAL(&sampler_lock);
+
+                //计算速度,边沿缓冲区为单生产者单消费者,不需要锁
+                for(int i=0;i<num;i++){
+                    Encoder* instance=instances[i];
+                    switch(instance->speed_mode){
+                        case ENCODER_SPEED_MT:
+                            instance->speed=instance->mt_estimator.update(instance->sample_count,now_time);
+                            break;
+                        case ENCODER_SPEED_OBSERVER:
+                            instance->speed=instance->observer.update(instance->sample_count,now_time);
+                            break;
+                        case ENCODER_SPEED_EDGE:{
+                            //取出本周期内捕获的全部边沿
+                            uint32_t tail=instance->edge_tail.load(std::memory_order_relaxed);
+                            uint32_t head=instance->edge_head.load(std::memory_order_acquire);
+                            for(;tail!=head;tail++){
+                                edge_t& edge=instance->edge_ring[tail&(HXC_ENCODER_EDGE_RING-1)];
+                                instance->edge_estimator.add_edge(edge.time_us,edge.dir);
+                            }
+                            instance->edge_tail.store(tail,std::memory_order_release);
+                            instance->speed=instance->edge_estimator.update(now_time);
+                            break;
+                        }
+                        default:{
+                            //计算增量
+                            int64_t delta=instance->sample_count-instance->last_count;
+                            //速度
+                            instance->speed=float(delta)/((now_time-instance->last_time)/1000000.f);
+                        }
                     }
+                    //更新
+                    instance->last_count=instance->sample_count;
+                    instance->last_time=now_time;
+                }
+                xSemaphoreGive(estimator_mutex());
+                if(sample_callback){
+                    sample_callback(now_time);
                 }
-                //累加
-                instance->count+=delta;
-                //速度
-                instance->speed=float(delta)/((now_time-instance->last_time)/1000000.f);
-                //更新
-                instance->last_count_row=now_count;
-                instance->last_time=now_time;
-                //延时
-                vTaskDelayUntil(&time,1000/instance->LOOPFREQ);//延时控制频率
             }
         };
         uint8_t PINA,PINB;//AB相引脚
-        int64_t count=0;//脉冲计数，默认4倍计数
-        uint8_t unit;//PCNT单元好号
-        static uint8_t used_unit;//已经使用的单元
+        volatile int32_t overflow_count=0;//PCNT上下限溢出次数,上溢+1下溢-1
+        int64_t count_offset=0;//reset_count设置的偏移
+        portMUX_TYPE count_lock=portMUX_INITIALIZER_UNLOCKED;//保护溢出次数与中断标志/GPIO计数的一致性
+        int8_t unit;//PCNT单元号,-1为GPIO中断后端
+        static uint32_t used_unit_mask;//已经使用的单元
+        static const int8_t quadrature_table[16];//正交解码表,下标为(上次AB<<2)|本次AB
+        volatile uint8_t gpio_state=0;//GPIO后端上次的AB电平
+        volatile int16_t gpio_count=0;//GPIO后端的计数,与PCNT计数器相同范围
+        volatile uint32_t error_count=0;//GPIO后端非法跳变次数
+        volatile uint64_t isr_cycles_sum=0;//GPIO中断累计耗时
+        volatile uint32_t isr_edges=0;//GPIO中断次数
+        bool gpio_isr_added=false;//是否已注册GPIO中断
+        struct edge_t{
+            int64_t time_us;
+            int8_t dir;
+        };
+        edge_t* edge_ring=nullptr;//边沿捕获环形缓冲区,中断写入,采样任务读取
+        std::atomic<uint32_t> edge_head{0};
+        std::atomic<uint32_t> edge_tail{0};
+        volatile uint32_t edge_dropped=0;//缓冲区满丢弃的边沿数
+        static pcnt_isr_handle_t pcnt_isr_handle;//所有单元共用的PCNT中断
+        static Encoder* pcnt_instances[HXC_ENCODER_PCNT_UNITS];//按单元号索引的编码器,供中断查找
+        bool is_setup=false;
         pcnt_config_t pcnt_config;
-        int last_count_row=0;
-        int LOOPFREQ=1000;//循环检测任务频率
+        int64_t sample_count=0;//最近一次共享采样的计数
+        int64_t last_count=0;//上一次测速的计数
         int64_t last_time=0;//上一次检测的时间
         float speed=0;//脉冲频率，单位Hz
-        TaskHandle_t counter_loop_handle=nullptr;//循环检测任务句柄
+        encoder_speed_mode_t speed_mode=ENCODER_SPEED_DELTA;//测速方法
+        MTSpeedEstimator mt_estimator;//M/T法测速
+        TrackingObserver observer;//跟踪观测器
+        EdgePeriodEstimator edge_estimator;//边沿测周法
+        static Encoder* instances[HXC_ENCODER_MAX];//参与采样的编码器
+        static int instance_num;//参与采样的编码器数量
+        static int LOOPFREQ;//共享采样任务频率
+        static int64_t sample_time_us;//最近一次采样时间
+        static portMUX_TYPE sampler_lock;//采样列表锁,只在读取计数和修改列表时短暂持有
+        static TaskHandle_t sampler_handle;//共享采样任务句柄
+        static std::function<void(int64_t)> sample_callback;//采样回调
 
 
 };
-uint8_t Encoder::used_unit=0;//已经使用的单元
+uint32_t Encoder::used_unit_mask=0;//已经使用的单元
+//00->10->11->01->00为正方向,与PCNT后端的计数方向一致
+DRAM_ATTR const int8_t Encoder::quadrature_table[16]={
+     0,-1, 1, 0,
+     1, 0, 0,-1,
+    -1, 0, 0, 1,
+     0, 1,-1, 0
+};
+pcnt_isr_handle_t Encoder::pcnt_isr_handle=nullptr;
+Encoder* Encoder::pcnt_instances[HXC_ENCODER_PCNT_UNITS]={nullptr};
+Encoder* Encoder::instances[HXC_ENCODER_MAX]={nullptr};
+int Encoder::instance_num=0;
+int Encoder::LOOPFREQ=0;
+int64_t Encoder::sample_time_us=0;
+portMUX_TYPE Encoder::sampler_lock=portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t Encoder::sampler_handle=nullptr;
+std::function<void(int64_t)> Encoder::sample_callback=nullptr;
 }
 #endif
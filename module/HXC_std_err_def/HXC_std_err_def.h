@@ -1,5 +1,5 @@
 /*
- * @version: v1.1.0
+ * @version: v1.2.0
  * @LastEditors: qingmeijiupiao
  * @Description: HXC标准错误头文件
  * @author: qingmeijiupiao
@@ -22,13 +22,54 @@ typedef int hxc_err_t;
 //超时
 #define HXC_ERR_TIMEOUT             0x107
 
+/*
+ * HXC统一时间基准
+ * now_time_us: 上电以来的单调64位微秒时间,不会像micros()一样约71分钟溢出
+ * now_cycle:   CPU周期计数,用于亚微秒级的短时间间隔测量,32位,240MHz下约17秒回绕,只能测短间隔
+ */
+#ifdef ARDUINO
 #include <Arduino.h>
+#include "esp_timer.h"
+static inline int64_t now_time_us() { 
+    return esp_timer_get_time(); 
+}
+
+static inline uint32_t now_cycle() { 
+    return ESP.getCycleCount(); 
+}
+
+//每微秒的CPU周期数
+static inline uint32_t cycle_per_us() { 
+    return ESP.getCpuFreqMHz(); 
+}
+#else
+//主机上使用clock_gettime,周期计数以纳秒代替
+#include <stdint.h>
+#include <time.h>
 static inline int64_t now_time_us() { 
-    return micros(); 
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return int64_t(ts.tv_sec)*1000000+ts.tv_nsec/1000; 
+}
+
+static inline uint32_t now_cycle() { 
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return uint32_t(uint64_t(ts.tv_sec)*1000000000u+ts.tv_nsec); 
 }
 
+static inline uint32_t cycle_per_us() { 
+    return 1000; 
+}
+#endif
+
 static inline int64_t now_time_ms() { 
-    return millis(); 
+    return now_time_us()/1000; 
+}
+
+//两次now_cycle()之差换算为微秒,回绕后相减仍然正确
+static inline float cycle_to_us(uint32_t cycles) { 
+    return float(cycles)/cycle_per_us(); 
 }
 
 #endif /* HXC_STD_DEF_HPP_ */
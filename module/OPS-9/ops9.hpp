@@ -77,7 +77,7 @@ class ops9 {
 					}
 					delay(1);
 				}
-				_serial->read(data, 26);
+				_serial->readBytes(data, 26);
 				if (data[24] == 0x0a && data[25] == 0x0d) {
 					int temp = data[0] + (data[1] << 8) + (data[2] << 16) +
 					           (data[3] << 24);
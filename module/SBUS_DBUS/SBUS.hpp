@@ -1,6 +1,7 @@
 #ifndef SBUS_HPP
 #define SBUS_HPP
 #include <Arduino.h>
+#include "SBUS_frame.hpp"
 
 class SBUS {
   public:
@@ -43,64 +44,10 @@ class SBUS {
 			if (obj->raw_data[0] != 0x0f) {
 				continue;
 			}
-			int check = ((int16_t)obj->raw_data[1] >> 0 |
-			                ((int16_t)obj->raw_data[2] << 8)) &
-			            0x07FF;
 			uint16_t channel_data_check[16];
 
 			//每11位为一个通道
-			channel_data_check[0] = ((int16_t)obj->raw_data[1] >> 0 |
-			                            ((int16_t)obj->raw_data[2] << 8)) &
-			                        0x07FF;
-			channel_data_check[1] = ((int16_t)obj->raw_data[2] >> 3 |
-			                            ((int16_t)obj->raw_data[3] << 5)) &
-			                        0x07FF;
-			channel_data_check[2] = ((int16_t)obj->raw_data[3] >> 6 |
-			                            ((int16_t)obj->raw_data[4] << 2) |
-			                            (int16_t)obj->raw_data[5] << 10) &
-			                        0x07FF;
-			channel_data_check[3] = ((int16_t)obj->raw_data[5] >> 1 |
-			                            ((int16_t)obj->raw_data[6] << 7)) &
-			                        0x07FF;
-			channel_data_check[4] = ((int16_t)obj->raw_data[6] >> 4 |
-			                            ((int16_t)obj->raw_data[7] << 4)) &
-			                        0x07FF;
-			channel_data_check[5] = ((int16_t)obj->raw_data[7] >> 7 |
-			                            ((int16_t)obj->raw_data[8] << 1) |
-			                            (int16_t)obj->raw_data[9] << 9) &
-			                        0x07FF;
-			channel_data_check[6] = ((int16_t)obj->raw_data[9] >> 2 |
-			                            ((int16_t)obj->raw_data[10] << 6)) &
-			                        0x07FF;
-			channel_data_check[7] = ((int16_t)obj->raw_data[10] >> 5 |
-			                            ((int16_t)obj->raw_data[11] << 3)) &
-			                        0x07FF;
-			channel_data_check[8] = ((int16_t)obj->raw_data[12] >> 0 |
-			                            ((int16_t)obj->raw_data[13] << 8)) &
-			                        0x07FF;
-			channel_data_check[9] = ((int16_t)obj->raw_data[13] >> 3 |
-			                            ((int16_t)obj->raw_data[14] << 5)) &
-			                        0x07FF;
-			channel_data_check[10] = ((int16_t)obj->raw_data[14] >> 6 |
-			                             ((int16_t)obj->raw_data[15] << 2) |
-			                             (int16_t)obj->raw_data[16] << 10) &
-			                         0x07FF;
-			channel_data_check[11] = ((int16_t)obj->raw_data[16] >> 1 |
-			                             ((int16_t)obj->raw_data[17] << 7)) &
-			                         0x07FF;
-			channel_data_check[12] = ((int16_t)obj->raw_data[17] >> 4 |
-			                             ((int16_t)obj->raw_data[18] << 4)) &
-			                         0x07FF;
-			channel_data_check[13] = ((int16_t)obj->raw_data[18] >> 7 |
-			                             ((int16_t)obj->raw_data[19] << 1) |
-			                             (int16_t)obj->raw_data[20] << 9) &
-			                         0x07FF;
-			channel_data_check[14] = ((int16_t)obj->raw_data[20] >> 2 |
-			                             ((int16_t)obj->raw_data[21] << 6)) &
-			                         0x07FF;
-			channel_data_check[15] = ((int16_t)obj->raw_data[21] >> 5 |
-			                             ((int16_t)obj->raw_data[22] << 3)) &
-			                         0x07FF;
+			sbus_unpack_channels(obj->raw_data, channel_data_check);
 
 			bool is_ok = true;
 			for (int i = 0; i < 16; i++) {
@@ -0,0 +1,122 @@
+/*
+ * @Description: SBUS发送端,用于转发/混控遥控器数据或者作为其他板子的SBUS信号源
+ * @Author: qingmeijiupiao
+ */
+#ifndef SBUS_TX_HPP
+#define SBUS_TX_HPP
+#include <Arduino.h>
+#include <functional>
+#include "SBUS_frame.hpp"
+
+//SBUS发送周期,高速模式7ms,普通模式14ms
+enum SBUS_TX_PERIOD {
+	SBUS_TX_PERIOD_7MS = 7,
+	SBUS_TX_PERIOD_14MS = 14
+};
+
+class SBUS_TX {
+  public:
+	//混控回调,在每帧打包前于发送任务中调用,可直接修改通道值和标志字节
+	using mix_callback_func = std::function<void(uint16_t *channel, uint8_t &flag)>;
+
+	SBUS_TX(const SBUS_TX &obj) = delete;
+	SBUS_TX &operator=(const SBUS_TX &obj) = delete;
+	SBUS_TX(uint8_t pin, HardwareSerial *serial) {
+		_pin = pin;
+		_serial = serial;
+	};
+	SBUS_TX(uint8_t pin) {
+		_pin = pin;
+		_serial = &Serial1;
+	};
+	~SBUS_TX() {
+		if (task_handle != nullptr) {
+			vTaskDelete(task_handle);
+		}
+	}
+
+	/**
+	 * @brief 初始化串口并启动发送任务
+	 * @param period 发送周期,默认14ms
+	 * @param invert 是否反相输出,SBUS标准电平为反相,直接接舵机/飞控时需要反相
+	 */
+	void setup(SBUS_TX_PERIOD period = SBUS_TX_PERIOD_14MS, bool invert = true) {
+		_period = period;
+		//只使用TX,RX引脚不分配
+		_serial->begin(100000, SERIAL_8E2, -1, _pin, invert);
+		//通道默认中位
+		for (int i = 0; i < SBUS_CHANNEL_NUM; i++) {
+			channel_data[i] = 1024;
+		}
+		if (task_handle == nullptr) {
+			xTaskCreate(tx_task, "sbus_tx", 2048, this, 3, &task_handle);
+		}
+	};
+
+	//设置通道值,通道号1-16,与SBUS接收端保持一致
+	void set_channel(uint8_t i, uint16_t value) {
+		if (i < 1 || i > SBUS_CHANNEL_NUM) return;
+		portENTER_CRITICAL(&lock);
+		channel_data[i - 1] = value & 0x07FF;
+		portEXIT_CRITICAL(&lock);
+	}
+
+	//一次设置全部16个通道
+	void set_channels(const uint16_t *channel) {
+		portENTER_CRITICAL(&lock);
+		for (int i = 0; i < SBUS_CHANNEL_NUM; i++) {
+			channel_data[i] = channel[i] & 0x07FF;
+		}
+		portEXIT_CRITICAL(&lock);
+	}
+
+	//设置标志字节,见SBUS_FLAG_*
+	void set_flag(uint8_t _flag) {
+		portENTER_CRITICAL(&lock);
+		flag = _flag;
+		portEXIT_CRITICAL(&lock);
+	}
+
+	//设置混控回调,用于转发时修改通道,传入nullptr取消
+	void set_mix_callback(mix_callback_func func) { mix_callback = func; }
+
+	uint16_t get_channel_data(uint8_t i) { return channel_data[i - 1]; }
+	//已发送帧数
+	uint32_t get_frame_count() { return frame_count; }
+
+  protected:
+	static void tx_task(void *p) {
+		SBUS_TX *obj = (SBUS_TX *)p;
+		uint16_t channel[SBUS_CHANNEL_NUM];
+		uint8_t frame_flag;
+		uint8_t frame[SBUS_FRAME_LEN];
+		TickType_t last_wake = xTaskGetTickCount();
+		while (true) {
+			//拷贝一份通道快照,避免打包过程中被修改
+			portENTER_CRITICAL(&obj->lock);
+			memcpy(channel, obj->channel_data, sizeof(channel));
+			frame_flag = obj->flag;
+			portEXIT_CRITICAL(&obj->lock);
+
+			if (obj->mix_callback) {
+				obj->mix_callback(channel, frame_flag);
+			}
+			sbus_pack_frame(channel, frame_flag, frame);
+			//一次写入整帧,由UART驱动发送
+			obj->_serial->write(frame, SBUS_FRAME_LEN);
+			obj->frame_count++;
+			vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(obj->_period));
+		}
+	}
+	uint8_t _pin;
+	HardwareSerial *_serial;
+	SBUS_TX_PERIOD _period = SBUS_TX_PERIOD_14MS;
+	uint16_t channel_data[SBUS_CHANNEL_NUM];
+	uint8_t flag = 0;
+	volatile uint32_t frame_count = 0;
+	mix_callback_func mix_callback = nullptr;
+	portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+	TaskHandle_t task_handle = nullptr;
+};
+
+#endif
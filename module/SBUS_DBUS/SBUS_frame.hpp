@@ -0,0 +1,69 @@
+/*
+ * @Description: SBUS帧编解码,不依赖Arduino,发送端/接收端/主机测试共用
+ * @Author: qingmeijiupiao
+ */
+#ifndef SBUS_FRAME_HPP
+#define SBUS_FRAME_HPP
+#include <stdint.h>
+
+//SBUS帧长度
+#define SBUS_FRAME_LEN 25
+//SBUS帧头
+#define SBUS_FRAME_HEADER 0x0F
+//SBUS帧尾
+#define SBUS_FRAME_FOOTER 0x00
+//SBUS通道数
+#define SBUS_CHANNEL_NUM 16
+
+//标志字节(帧第23字节)各位定义
+#define SBUS_FLAG_CH17        0x01 //数字通道17
+#define SBUS_FLAG_CH18        0x02 //数字通道18
+#define SBUS_FLAG_FRAME_LOST  0x04 //丢帧
+#define SBUS_FLAG_FAILSAFE    0x08 //失控保护
+
+/**
+ * @brief 将16个11位通道和标志字节打包为25字节SBUS帧
+ * @param channel 16个通道值,仅使用低11位
+ * @param flag 标志字节,见SBUS_FLAG_*
+ * @param frame 输出缓冲区,至少25字节
+ */
+static inline void sbus_pack_frame(const uint16_t *channel, uint8_t flag, uint8_t *frame) {
+	frame[0] = SBUS_FRAME_HEADER;
+	uint32_t bits = 0;
+	int bit_num = 0;
+	int index = 1;
+	//每11位为一个通道,低位在前
+	for (int i = 0; i < SBUS_CHANNEL_NUM; i++) {
+		bits |= (uint32_t)(channel[i] & 0x07FF) << bit_num;
+		bit_num += 11;
+		while (bit_num >= 8) {
+			frame[index++] = bits & 0xFF;
+			bits >>= 8;
+			bit_num -= 8;
+		}
+	}
+	frame[23] = flag;
+	frame[24] = SBUS_FRAME_FOOTER;
+}
+
+/**
+ * @brief 从25字节SBUS帧中解出16个通道值
+ * @param frame SBUS帧,frame[0]为帧头
+ * @param channel 输出的16个通道值
+ */
+static inline void sbus_unpack_channels(const uint8_t *frame, uint16_t *channel) {
+	uint32_t bits = 0;
+	int bit_num = 0;
+	int index = 1;
+	for (int i = 0; i < SBUS_CHANNEL_NUM; i++) {
+		while (bit_num < 11) {
+			bits |= (uint32_t)frame[index++] << bit_num;
+			bit_num += 8;
+		}
+		channel[i] = bits & 0x07FF;
+		bits >>= 11;
+		bit_num -= 11;
+	}
+}
+
+#endif
@@ -0,0 +1,18 @@
+#include "SerialCapture.hpp"
+#include "ops9.hpp"
+
+//用抓取串口替换Serial2
+HXC::CaptureSerial capture_serial(2);
+ops9 OPS9(&capture_serial);
+
+void setup() {
+    Serial.begin(921600);//调试串口初始化
+    OPS9.setup();
+}
+void loop() {
+    //发送字符d导出日志
+    if (Serial.available() && Serial.read() == 'd') {
+        capture_serial.dump(Serial, true);
+    }
+    delay(10);
+}
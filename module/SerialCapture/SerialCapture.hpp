@@ -0,0 +1,214 @@
+/*
+ * @Description: 串口原始数据抓取与回放,用于复现SBUS/DBUS/OPS-9/HEServo/EMMC42V5等串口模块的解析问题
+ * @Author: qingmeijiupiao
+ */
+#ifndef HXC_SERIAL_CAPTURE_HPP
+#define HXC_SERIAL_CAPTURE_HPP
+#include <Arduino.h>
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "SerialLog.hpp"
+
+//默认日志缓冲区大小
+#ifndef SERIAL_CAPTURE_DEFAULT_SIZE
+#define SERIAL_CAPTURE_DEFAULT_SIZE (32*1024)
+#endif
+
+//每次持锁记录的最大字节数,长数据分段记录,限制关中断的时间
+#ifndef SERIAL_CAPTURE_LOCK_CHUNK
+#define SERIAL_CAPTURE_LOCK_CHUNK 32
+#endif
+
+namespace HXC{
+
+/**
+ * @brief 带抓取功能的串口,直接替换原来的Serial1/Serial2传给各模块即可
+ * @note  通过read/peek/readBytes/write读写的数据都会带时间戳记录到环形日志,
+ *        有PSRAM时日志缓冲区优先放在PSRAM
+ */
+class CaptureSerial : public HardwareSerial {
+    public:
+        /**
+         * @param uart_nr 串口号,与HardwareSerial一致
+         * @param log_size 日志缓冲区大小
+         */
+        CaptureSerial(int uart_nr,size_t log_size=SERIAL_CAPTURE_DEFAULT_SIZE)
+        :HardwareSerial(uart_nr),port(uart_nr),log(alloc_buffer(log_size),log_size){}
+        CaptureSerial(CaptureSerial&)=delete;
+        CaptureSerial& operator=(CaptureSerial&)=delete;
+
+        int read(void) override {
+            int byte=HardwareSerial::read();
+            if(byte>=0&&enable){
+                uint8_t b=byte;
+                record(SERIAL_LOG_RX,&b,1);
+            }
+            return byte;
+        }
+        size_t read(uint8_t *buffer,size_t size){
+            size_t n=HardwareSerial::read(buffer,size);
+            if(n>0&&enable) record(SERIAL_LOG_RX,buffer,n);
+            return n;
+        }
+        size_t readBytes(uint8_t *buffer,size_t length) override {
+            //按字节走read(),超时行为与Stream一致
+            return Stream::readBytes((char*)buffer,length);
+        }
+        size_t readBytes(char *buffer,size_t length) override {
+            return Stream::readBytes(buffer,length);
+        }
+        size_t write(uint8_t byte) override {
+            if(enable) record(SERIAL_LOG_TX,&byte,1);
+            return HardwareSerial::write(byte);
+        }
+        size_t write(const uint8_t *buffer,size_t size) override {
+            if(enable) record(SERIAL_LOG_TX,buffer,size);
+            return HardwareSerial::write(buffer,size);
+        }
+        using Print::write;
+
+        //开始/暂停抓取
+        void set_capture_enable(bool _enable){enable=_enable;}
+
+        /**
+         * @brief 导出日志到指定输出,默认通过Serial以二进制导出
+         * @param out 输出,例如Serial
+         * @param clear_after 导出后是否清空
+         */
+        void dump(Print& out=Serial,bool clear_after=false){
+            //导出期间日志不再修改,record()在锁内检查dumping,置位后已在进行的记录也已完成
+            portENTER_CRITICAL(&lock);
+            dumping=true;
+            portEXIT_CRITICAL(&lock);
+            log.dump(out,port);
+            portENTER_CRITICAL(&lock);
+            if(clear_after) log.clear();
+            dumping=false;
+            portEXIT_CRITICAL(&lock);
+        }
+
+        //清空日志,导出过程中调用无效
+        void clear(){
+            portENTER_CRITICAL(&lock);
+            if(!dumping) log.clear();
+            portEXIT_CRITICAL(&lock);
+        }
+
+        //日志已使用字节数
+        size_t get_log_used(){return log.get_used();}
+        //缓冲区满丢弃的记录数
+        uint32_t get_dropped(){return log.get_dropped();}
+
+    protected:
+        //分段持锁,同一时间戳的相邻分段在日志中合并为一条记录
+        void record(serial_log_dir_t dir,const uint8_t* data,size_t len){
+            int64_t now=esp_timer_get_time();
+            while(len>0){
+                size_t n=len>SERIAL_CAPTURE_LOCK_CHUNK?SERIAL_CAPTURE_LOCK_CHUNK:len;
+                portENTER_CRITICAL(&lock);
+                //导出期间的数据丢弃
+                bool skip=dumping;
+                if(!skip) log.record(dir,data,n,now);
+                portEXIT_CRITICAL(&lock);
+                if(skip) return;
+                data+=n;
+                len-=n;
+            }
+        }
+        static uint8_t* alloc_buffer(size_t size){
+            uint8_t* buffer=(uint8_t*)heap_caps_malloc(size,MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT);
+            if(buffer==nullptr){
+                buffer=(uint8_t*)malloc(size);
+            }
+            if(buffer==nullptr){
+                log_e("CaptureSerial: log buffer alloc failed");
+            }
+            return buffer;
+        }
+        uint8_t port;
+        SerialLog log;
+        volatile bool enable=true;
+        bool dumping=false;//正在导出,只在lock内读写
+        portMUX_TYPE lock=portMUX_INITIALIZER_UNLOCKED;
+};
+
+/**
+ * @brief 回放串口,把抓取的日志按原速或加速喂给未修改的解码类
+ * @note  解码类仍会调用begin()初始化硬件串口,但读到的数据全部来自日志,写入的数据被丢弃
+ */
+class ReplaySerial : public HardwareSerial {
+    public:
+        /**
+         * @param uart_nr 串口号
+         * @param log 导出的日志数据(含文件头),需在回放期间保持有效
+         * @param len 日志长度
+         * @param speed 回放倍速,1为原速,<=0为尽快回放
+         */
+        ReplaySerial(int uart_nr,const uint8_t* log,size_t len,float speed=1.f)
+        :HardwareSerial(uart_nr),player(log,len,speed){}
+
+        int available(void) override {
+            portENTER_CRITICAL(&lock);
+            player.update(esp_timer_get_time());
+            int n=player.available();
+            portEXIT_CRITICAL(&lock);
+            return n;
+        }
+        int peek(void) override {
+            portENTER_CRITICAL(&lock);
+            player.update(esp_timer_get_time());
+            int byte=player.peek();
+            portEXIT_CRITICAL(&lock);
+            return byte;
+        }
+        int read(void) override {
+            portENTER_CRITICAL(&lock);
+            player.update(esp_timer_get_time());
+            int byte=player.read();
+            portEXIT_CRITICAL(&lock);
+            return byte;
+        }
+        size_t read(uint8_t *buffer,size_t size){
+            size_t n=0;
+            while(n<size&&available()>0){
+                buffer[n++]=read();
+            }
+            return n;
+        }
+        size_t readBytes(uint8_t *buffer,size_t length) override {
+            return Stream::readBytes((char*)buffer,length);
+        }
+        size_t readBytes(char *buffer,size_t length) override {
+            return Stream::readBytes(buffer,length);
+        }
+        size_t write(uint8_t) override {
+            tx_bytes++;
+            return 1;
+        }
+        size_t write(const uint8_t *,size_t size) override {
+            tx_bytes+=size;
+            return size;
+        }
+        using Print::write;
+
+        //日志是否有效
+        bool is_valid(){return player.is_valid();}
+        //回放是否结束
+        bool finished(){return player.finished();}
+        //重新开始回放
+        void rewind(){
+            portENTER_CRITICAL(&lock);
+            player.rewind();
+            portEXIT_CRITICAL(&lock);
+        }
+        //解码类写入的字节数
+        uint32_t get_tx_bytes(){return tx_bytes;}
+
+    protected:
+        SerialLogPlayer player;
+        volatile uint32_t tx_bytes=0;
+        portMUX_TYPE lock=portMUX_INITIALIZER_UNLOCKED;
+};
+
+}
+#endif
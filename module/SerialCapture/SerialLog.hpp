@@ -0,0 +1,325 @@
+/*
+ * @Description: 串口原始数据日志格式,环形缓冲区记录与回放,不依赖Arduino,可在主机上使用
+ * @Author: qingmeijiupiao
+ */
+#ifndef HXC_SERIAL_LOG_HPP
+#define HXC_SERIAL_LOG_HPP
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * 导出格式(小端):
+ *   文件头20字节: "HXSL"(4) | 版本(1) | 端口号(1) | 保留(2) | 记录区长度(4) | 起始时间us(8)
+ *   记录: 头字节(bit7:方向 0=RX 1=TX, bit0-6:长度-1) | 距上一条记录的时间差us(LEB128变长) | 数据
+ */
+#define HXC_SERIAL_LOG_MAGIC "HXSL"
+#define HXC_SERIAL_LOG_VERSION 1
+#define HXC_SERIAL_LOG_HEADER_LEN 20
+//单条记录最大数据长度
+#define HXC_SERIAL_LOG_MAX_RECORD 128
+
+namespace HXC {
+
+enum serial_log_dir_t : uint8_t {
+    SERIAL_LOG_RX = 0,//从串口读出,即解码器收到的数据
+    SERIAL_LOG_TX = 1 //写入串口,即发给设备的数据
+};
+
+/**
+ * @brief 串口数据环形日志,缓冲区满时丢弃最旧的记录
+ * @note  本类不加锁,多任务访问时由调用者保证互斥
+ */
+class SerialLog {
+    public:
+        /**
+         * @param _buffer 外部提供的缓冲区(可位于PSRAM)
+         * @param _size 缓冲区大小
+         * @param _merge_window_us 同方向且间隔小于该值的字节合并为一条记录
+         */
+        SerialLog(uint8_t* _buffer,size_t _size,uint32_t _merge_window_us=100)
+        :buffer(_buffer),size(_size),merge_window_us(_merge_window_us){}
+
+        /**
+         * @brief 记录一段数据
+         * @param dir 方向
+         * @param data 数据
+         * @param len 数据长度
+         * @param time_us 当前时间,单位us,需单调递增
+         */
+        void record(serial_log_dir_t dir,const uint8_t* data,size_t len,int64_t time_us){
+            if(buffer==nullptr) return;
+            while(len>0){
+                //尝试追加到上一条记录
+                if(last_valid&&dir==last_dir&&last_len<HXC_SERIAL_LOG_MAX_RECORD
+                   &&time_us-last_time_us<=merge_window_us){
+                    size_t n=HXC_SERIAL_LOG_MAX_RECORD-last_len;
+                    if(n>len) n=len;
+                    //先保证空间,腾空间时可能丢掉上一条记录本身
+                    if(!make_room(n)) return;
+                    if(last_valid){
+                        for(size_t i=0;i<n;i++) push(data[i]);
+                        last_len+=n;
+                        buffer[last_hdr_pos]=(dir<<7)|(last_len-1);
+                        data+=n;len-=n;
+                        continue;
+                    }
+                }
+                size_t n=len>HXC_SERIAL_LOG_MAX_RECORD?HXC_SERIAL_LOG_MAX_RECORD:len;
+                uint64_t delta=(empty()||time_us<head_time_us)?0:uint64_t(time_us-head_time_us);
+                uint8_t varint[10];
+                size_t varint_len=encode_varint(delta,varint);
+                if(!make_room(1+varint_len+n)) return;
+                if(empty()){
+                    //缓冲区为空时以本条记录时间作为起点
+                    tail_time_us=time_us;
+                    delta=0;
+                    varint_len=encode_varint(0,varint);
+                }
+                last_hdr_pos=head;
+                push((dir<<7)|(n-1));
+                for(size_t i=0;i<varint_len;i++) push(varint[i]);
+                for(size_t i=0;i<n;i++) push(data[i]);
+                head_time_us=time_us;
+                last_time_us=time_us;
+                last_dir=dir;
+                last_len=n;
+                last_valid=true;
+                data+=n;len-=n;
+            }
+        }
+
+        //清空日志
+        void clear(){
+            head=tail=used=0;
+            last_valid=false;
+            dropped_records=0;
+        }
+
+        bool empty(){return used==0;}
+        //已使用字节数
+        size_t get_used(){return used;}
+        //因缓冲区满丢弃的记录数
+        uint32_t get_dropped(){return dropped_records;}
+
+        /**
+         * @brief 导出日志,格式见文件开头说明
+         * @param out 任何有 write(const uint8_t*,size_t) 方法的对象,例如Serial
+         * @param port 串口编号,写入文件头
+         */
+        template<typename Output>
+        void dump(Output& out,uint8_t port=0){
+            uint8_t header[HXC_SERIAL_LOG_HEADER_LEN];
+            memcpy(header,HXC_SERIAL_LOG_MAGIC,4);
+            header[4]=HXC_SERIAL_LOG_VERSION;
+            header[5]=port;
+            header[6]=0;
+            header[7]=0;
+            put_le(header+8,used,4);
+            put_le(header+12,uint64_t(tail_time_us),8);
+            out.write(header,HXC_SERIAL_LOG_HEADER_LEN);
+            //环形缓冲区分两段写出
+            size_t first=size-tail;
+            if(first>used) first=used;
+            out.write(buffer+tail,first);
+            if(used>first) out.write(buffer,used-first);
+        }
+
+        //LEB128编码,返回编码长度
+        static size_t encode_varint(uint64_t value,uint8_t* out){
+            size_t n=0;
+            do{
+                uint8_t byte=value&0x7F;
+                value>>=7;
+                if(value) byte|=0x80;
+                out[n++]=byte;
+            }while(value);
+            return n;
+        }
+
+        static void put_le(uint8_t* out,uint64_t value,int len){
+            for(int i=0;i<len;i++){
+                out[i]=value&0xFF;
+                value>>=8;
+            }
+        }
+    protected:
+        void push(uint8_t byte){
+            buffer[head]=byte;
+            head=(head+1==size)?0:head+1;
+            used++;
+        }
+        uint8_t at(size_t offset){
+            size_t pos=tail+offset;
+            if(pos>=size) pos-=size;
+            return buffer[pos];
+        }
+        //丢弃最旧的记录直到有need字节空闲,记录比整个缓冲区还大时返回false
+        bool make_room(size_t need){
+            if(need>size) return false;
+            while(size-used<need){
+                uint8_t hdr=at(0);
+                size_t offset=1;
+                uint64_t delta=0;
+                int shift=0;
+                uint8_t byte;
+                do{
+                    byte=at(offset++);
+                    delta|=uint64_t(byte&0x7F)<<shift;
+                    shift+=7;
+                }while(byte&0x80);
+                size_t record_len=offset+(hdr&0x7F)+1;
+                if(tail==last_hdr_pos) last_valid=false;
+                tail_time_us+=delta;
+                tail=(tail+record_len)%size;
+                used-=record_len;
+                dropped_records++;
+            }
+            return true;
+        }
+        uint8_t* buffer;
+        size_t size;
+        uint32_t merge_window_us;
+        size_t head=0;//写入位置
+        size_t tail=0;//最旧记录位置
+        size_t used=0;
+        int64_t tail_time_us=0;//最旧记录之前的参考时间
+        int64_t head_time_us=0;//最新记录的时间
+        //用于合并的上一条记录信息
+        size_t last_hdr_pos=0;
+        int64_t last_time_us=0;
+        serial_log_dir_t last_dir=SERIAL_LOG_RX;
+        size_t last_len=0;
+        bool last_valid=false;
+        uint32_t dropped_records=0;
+};
+
+/**
+ * @brief 导出日志的回放器,按照记录的时间(或加速)释放RX数据
+ * @note  不依赖硬件,主机上可直接把日志喂给解码逻辑
+ */
+class SerialLogPlayer {
+    public:
+        /**
+         * @param _log 导出的日志数据(含文件头)
+         * @param _len 日志长度
+         * @param _speed 回放倍速,1为原速,<=0为不等待立即释放全部数据
+         */
+        SerialLogPlayer(const uint8_t* _log,size_t _len,float _speed=1.f)
+        :log(_log),log_len(_len),speed(_speed){
+            valid=_len>=HXC_SERIAL_LOG_HEADER_LEN&&memcmp(_log,HXC_SERIAL_LOG_MAGIC,4)==0
+                  &&_log[4]==HXC_SERIAL_LOG_VERSION;
+            if(!valid) return;
+            uint64_t length=get_le(_log+8,4);
+            end=HXC_SERIAL_LOG_HEADER_LEN+length;
+            if(end>_len) end=_len;
+            start_time_us=int64_t(get_le(_log+12,8));
+            rewind();
+        }
+
+        bool is_valid(){return valid;}
+
+        //从头开始回放
+        void rewind(){
+            release_pos=HXC_SERIAL_LOG_HEADER_LEN;
+            release_time_us=start_time_us;
+            read_record_left=0;
+            read_pos=HXC_SERIAL_LOG_HEADER_LEN;
+            available_bytes=0;
+            started=false;
+        }
+
+        /**
+         * @brief 推进回放时间,释放已到时间的RX数据
+         * @param now_us 当前时间,单位us,第一次调用时作为回放起点
+         */
+        void update(int64_t now_us){
+            if(!valid) return;
+            if(!started){
+                play_start_us=now_us;
+                started=true;
+            }
+            double elapsed=speed>0?double(now_us-play_start_us)*speed:1e300;
+            while(release_pos<end){
+                size_t pos=release_pos;
+                uint8_t hdr=log[pos++];
+                uint64_t delta=read_varint(pos);
+                if(double(release_time_us+int64_t(delta)-start_time_us)>elapsed) break;
+                size_t len=(hdr&0x7F)+1;
+                if(pos+len>end) {release_pos=end;break;}
+                release_time_us+=delta;
+                if(!(hdr&0x80)) available_bytes+=len;
+                release_pos=pos+len;
+            }
+        }
+
+        //已释放且未读取的RX字节数
+        int available(){return int(available_bytes);}
+
+        int peek(){
+            if(!seek_rx()) return -1;
+            return log[read_pos];
+        }
+
+        int read(){
+            if(!seek_rx()) return -1;
+            uint8_t byte=log[read_pos++];
+            read_record_left--;
+            available_bytes--;
+            return byte;
+        }
+
+        //回放是否结束
+        bool finished(){return release_pos>=end&&available_bytes==0;}
+
+    protected:
+        //将读指针移动到下一个可读的RX字节
+        bool seek_rx(){
+            if(available_bytes==0) return false;
+            while(read_record_left==0){
+                uint8_t hdr=log[read_pos++];
+                read_varint(read_pos);
+                size_t len=(hdr&0x7F)+1;
+                if(hdr&0x80){
+                    read_pos+=len;//跳过TX记录
+                }else{
+                    read_record_left=len;
+                }
+            }
+            return true;
+        }
+        uint64_t read_varint(size_t& pos){
+            uint64_t value=0;
+            int shift=0;
+            while(pos<end){
+                uint8_t byte=log[pos++];
+                value|=uint64_t(byte&0x7F)<<shift;
+                shift+=7;
+                if(!(byte&0x80)) break;
+            }
+            return value;
+        }
+        static uint64_t get_le(const uint8_t* in,int len){
+            uint64_t value=0;
+            for(int i=len-1;i>=0;i--) value=(value<<8)|in[i];
+            return value;
+        }
+        const uint8_t* log;
+        size_t log_len;
+        float speed;
+        bool valid=false;
+        size_t end=0;
+        int64_t start_time_us=0;
+        //释放进度
+        size_t release_pos=0;
+        int64_t release_time_us=0;
+        //读取进度
+        size_t read_pos=0;
+        size_t read_record_left=0;
+        size_t available_bytes=0;
+        bool started=false;
+        int64_t play_start_us=0;
+};
+
+}
+#endif
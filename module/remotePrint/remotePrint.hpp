@@ -4,8 +4,18 @@
 #include "ESPNOW.hpp"  // 包含ESP-NOW通信库
 #include <inttypes.h>  // 标准整数类型头文件
 #include "Print.h"     // Arduino打印功能基类
+#include "esp_timer.h" // 定时刷新缓冲区
+
+// 单个数据包最大字节数，取v1格式(名称"remotePrint"占11字节)和v2格式中较小的
+#define REMOTE_PRINT_BUFFER_SIZE (ESP_NOW_MAX_DATA_LEN-4-11)
+
+// 缓冲区中的数据超过该时间没有换行也会发送，单位ms
+#ifndef REMOTE_PRINT_FLUSH_MS
+#define REMOTE_PRINT_FLUSH_MS 10
+#endif
 
 // 远程打印类，继承自Arduino的Print类
+// 输出先写入所在核心的缓冲区，遇到换行、缓冲区满或超时才发送一个数据包
 class remotePrint_t : public Print {
 private:
     // 私有构造函数（单例模式关键）
@@ -22,9 +32,72 @@ private:
     // 接收端的MAC地址，默认设置为广播地址
     MAC_t receive_MAC = broadcastMacAddress;
 
+    // 每个核心一个缓冲区，同一核心上的任务用自旋锁互斥，不同核心互不影响
+    struct buffer_t {
+        uint8_t data[REMOTE_PRINT_BUFFER_SIZE];
+        size_t len = 0;
+        int64_t first_write_us = 0; // 缓冲区中第一个字节写入的时间
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+    };
+    buffer_t buffers[portNUM_PROCESSORS];
+
+    // 超时刷新定时器
+    esp_timer_handle_t flush_timer = nullptr;
+
+    // 统计
+    volatile uint32_t packet_count = 0;  // 发送的数据包数
+    volatile uint32_t line_count = 0;    // 写入的换行数
+    volatile uint32_t byte_count = 0;    // 发送的字节数
+    volatile uint32_t dropped_count = 0; // 发送队列满丢弃的数据包数
+
+    // 发送一个数据包，按ESP-NOW库当前的发送格式
+    void send_packet(const uint8_t* data, size_t len) {
+        esp_err_t err;
+        if (send_version == 1) {
+            err = esp_now_send_package("remotePrint", const_cast<uint8_t*>(data), len, receive_MAC, HXC_ESPNOW_PRIO_LOW);
+        } else {
+            err = esp_now_send_topic(ESPNOW_TOPIC_ID("remotePrint"), data, len, receive_MAC, 0, HXC_ESPNOW_PRIO_LOW);
+        }
+        if (err == ESP_OK) {
+            packet_count++;
+            byte_count += len;
+        } else {
+            dropped_count++;
+        }
+    }
+
+    // 取出缓冲区内容并发送，发送在锁外进行
+    // 参数：
+    //   buffer: 要刷新的缓冲区
+    //   timeout_only: 为true时只刷新超时的缓冲区
+    void flush_buffer(buffer_t& buffer, bool timeout_only) {
+        uint8_t packet[REMOTE_PRINT_BUFFER_SIZE];
+        size_t len = 0;
+        portENTER_CRITICAL(&buffer.lock);
+        if (buffer.len > 0 && (!timeout_only || esp_timer_get_time() - buffer.first_write_us >= REMOTE_PRINT_FLUSH_MS * 1000)) {
+            len = buffer.len;
+            memcpy(packet, buffer.data, len);
+            buffer.len = 0;
+        }
+        portEXIT_CRITICAL(&buffer.lock);
+        if (len > 0) send_packet(packet, len);
+    }
+
+    // 定时器回调，刷新超时的缓冲区
+    static void flush_timer_callback(void* arg) {
+        remotePrint_t* self = static_cast<remotePrint_t*>(arg);
+        for (int i = 0; i < portNUM_PROCESSORS; i++) {
+            self->flush_buffer(self->buffers[i], true);
+        }
+    }
+
 public:
     // 析构函数
     ~remotePrint_t() {
+        if (flush_timer != nullptr) { // 删除刷新定时器
+            esp_timer_stop(flush_timer);
+            esp_timer_delete(flush_timer);
+        }
         instance = nullptr; // 清除实例指针
     }
 
@@ -44,6 +117,15 @@ public:
         change_secret_key(_secret_key);  // 设置通信密钥
         receive_MAC = _receive_MAC;     // 更新目标MAC地址
         esp_now_setup(_receive_MAC);    // 初始化ESP-NOW通信
+        if (flush_timer == nullptr) {   // 创建超时刷新定时器
+            esp_timer_create_args_t timer_args = {};
+            timer_args.callback = flush_timer_callback;
+            timer_args.arg = this;
+            timer_args.dispatch_method = ESP_TIMER_TASK;
+            timer_args.name = "remotePrint";
+            esp_timer_create(&timer_args, &flush_timer);
+            esp_timer_start_periodic(flush_timer, REMOTE_PRINT_FLUSH_MS * 1000 / 2);
+        }
     }
     
     // 实现Print类的write方法（单字节版本）
@@ -51,19 +133,60 @@ public:
     //   data: 要发送的单个字节
     // 返回值：实际写入的字节数（总是1）
     size_t write(uint8_t data) override {
-        esp_now_send_package("remotePrint", &data, 1, receive_MAC);
-        return 1;
+        return write(&data, 1);
     };
     
     // 实现Print类的write方法（缓冲区版本）
+    // 数据先写入当前核心的缓冲区，遇到换行或缓冲区满时发送
     // 参数：
     //   buffer: 要发送的数据缓冲区
     //   size: 要发送的数据大小
     // 返回值：实际写入的字节数
     size_t write(const uint8_t *buffer, size_t size) override {
-        esp_now_send_package("remotePrint", const_cast<uint8_t*>(buffer), size, receive_MAC);
+        buffer_t& local = buffers[xPortGetCoreID()];
+        uint8_t packet[REMOTE_PRINT_BUFFER_SIZE];
+        size_t written = 0;
+        while (written < size) {
+            size_t packet_len = 0;
+            portENTER_CRITICAL(&local.lock);
+            if (local.len == 0) local.first_write_us = esp_timer_get_time();
+            while (written < size && local.len < REMOTE_PRINT_BUFFER_SIZE) {
+                uint8_t c = buffer[written++];
+                local.data[local.len++] = c;
+                if (c == '\n') {
+                    line_count++;
+                    break;
+                }
+            }
+            // 换行或缓冲区满，取出整包
+            if (local.len == REMOTE_PRINT_BUFFER_SIZE || local.data[local.len - 1] == '\n') {
+                packet_len = local.len;
+                memcpy(packet, local.data, packet_len);
+                local.len = 0;
+            }
+            portEXIT_CRITICAL(&local.lock);
+            if (packet_len > 0) send_packet(packet, packet_len);
+        }
         return size;
     };
+
+    // 立即发送所有缓冲区中的数据
+    void flush() {
+        for (int i = 0; i < portNUM_PROCESSORS; i++) {
+            flush_buffer(buffers[i], false);
+        }
+    }
+
+    // 已发送的数据包数
+    uint32_t get_packet_count() { return packet_count; }
+    // 已写入的行数
+    uint32_t get_line_count() { return line_count; }
+    // 已发送的字节数
+    uint32_t get_byte_count() { return byte_count; }
+    // 发送队列满丢弃的数据包数
+    uint32_t get_dropped_count() { return dropped_count; }
+    // 平均每行的数据包数，合并发送时应接近1
+    float get_packets_per_line() { return line_count ? float(packet_count) / line_count : 0.f; }
     
     // 销毁单例实例的静态方法
     // 注意：需要时手动调用以释放资源
@@ -1,18 +1,42 @@
 #ifndef VOFA_HPP
 #define VOFA_HPP
 #include "Arduino.h"
-#include <map>
 #include <list>
+#include <functional>
+
+//参数表容量,必须是2的幂,注册的参数个数不能超过该值的一半
+#ifndef VOFA_TABLE_SIZE
+#define VOFA_TABLE_SIZE 128
+#endif
+
+//单条命令最大长度,超过的命令会被丢弃
+#ifndef VOFA_LINE_MAX
+#define VOFA_LINE_MAX 64
+#endif
+
+/**
+ * @brief 参数名哈希(FNV-1a),constexpr,字符串常量可在编译期求值
+ * @param str 参数名
+ * @param hash 初始值
+ */
+constexpr uint32_t VOFA_HASH(const char* str,uint32_t hash=2166136261u){
+    return *str?VOFA_HASH(str+1,(hash^uint8_t(*str))*16777619u):hash;
+}
+
 class VOFA_float{
     public:
     VOFA_float(String _name,float default_value){
         this->name=_name;
+        this->name_ptr=this->name.c_str();
         this->value=default_value;
-        name_to_value_map[this->name]=this;
-
+        this->hash=VOFA_HASH(this->name_ptr);
+        register_param(this);
     };
+    VOFA_float(const VOFA_float&)=delete;
+    VOFA_float& operator=(const VOFA_float&)=delete;
     static void setup(){
         if(!is_setup){
+            is_setup=true;
             xTaskCreate(read_loop,"read_loop",8192,NULL,5,NULL);
         }
     }
@@ -22,42 +46,196 @@ class VOFA_float{
     float read(){
         return value;
     }
+    const char* get_name(){
+        return name_ptr;
+    }
+
+    /**
+     * @brief 按名称查找已注册的参数
+     * @param name 参数名
+     * @param len 参数名长度
+     * @return 找到返回参数指针,否则返回nullptr
+     */
+    static VOFA_float* find(const char* name,size_t len){
+        uint32_t h=2166136261u;
+        for(size_t i=0;i<len;i++){
+            h=(h^uint8_t(name[i]))*16777619u;
+        }
+        for(uint32_t i=0;i<VOFA_TABLE_SIZE;i++){
+            VOFA_float* item=table[(h+i)&(VOFA_TABLE_SIZE-1)];
+            if(item==nullptr) return nullptr;
+            if(item->hash==h&&strncmp(item->name_ptr,name,len)==0&&item->name_ptr[len]=='\0'){
+                return item;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief 处理一条"名称:数值"格式的命令,不分配内存
+     * @param line 命令,不含换行符
+     * @param len 命令长度
+     * @return 命令格式正确且参数存在返回true
+     */
+    static bool handle_command(const char* line,size_t len){
+        const char* colon=(const char*)memchr(line,':',len);
+        if(colon==nullptr) return false;
+        size_t name_len=colon-line;
+        float new_value=0;
+        if(!parse_float(colon+1,line+len,new_value)) return false;
+        VOFA_float* item=find(line,name_len);
+        if(item==nullptr){
+            Serial.print("VOFA_float: ");
+            Serial.write((const uint8_t*)line,name_len);
+            Serial.println(" not found");
+            return false;
+        }
+        //值没有变化时不触发回调
+        if(item->value==new_value) return true;
+        item->value=new_value;
+        if(item->on_change_callback){
+            item->on_change_callback(new_value);
+        }
+        //兼容旧的全局回调,仅在注册了回调时才构造String
+        if(on_value_change_callback_list.size()!=0){
+            String name_str(item->name_ptr);
+            for(std::function<void(String,float)>& callback:on_value_change_callback_list){
+                callback(name_str,new_value);
+            }
+        }
+        return true;
+    }
 
+    /**
+     * @brief 设置本参数的变化回调,仅在本参数的值实际改变时调用
+     * @param callback 回调函数,参数为新值,在VOFA读取任务中运行,传入nullptr取消
+     */
+    void on_change(std::function<void(float)> callback){
+        on_change_callback=callback;
+    }
+
+    //全局回调,任意已注册参数的值改变时调用,新代码建议使用on_change
     static void add_on_value_change_callback(std::function<void(String,float)> callback){
         on_value_change_callback_list.push_back(callback);
     }
     protected:
     float value;
     String name;
-    static std::map<String, VOFA_float*>name_to_value_map;
+    const char* name_ptr;//指向name的内容,构造后不再修改
+    uint32_t hash;
+    std::function<void(float)> on_change_callback=nullptr;
+    //开放寻址参数表,静态零初始化,不受全局对象构造顺序影响
+    static VOFA_float* table[VOFA_TABLE_SIZE];
     static std::list<std::function<void(String,float)>>on_value_change_callback_list;
     static bool is_setup;
+
+    //注册参数,同名参数后注册的覆盖先注册的
+    static void register_param(VOFA_float* param){
+        for(uint32_t i=0;i<VOFA_TABLE_SIZE;i++){
+            VOFA_float*& slot=table[(param->hash+i)&(VOFA_TABLE_SIZE-1)];
+            if(slot==nullptr||(slot->hash==param->hash&&strcmp(slot->name_ptr,param->name_ptr)==0)){
+                slot=param;
+                return;
+            }
+        }
+        log_e("VOFA_float: table full, %s not registered",param->name_ptr);
+    }
+
+    /**
+     * @brief 原地解析浮点数,支持符号,小数点和指数,忽略首尾空白
+     * @param begin 起始位置
+     * @param end 结束位置
+     * @param out 解析结果
+     * @return 是否解析成功
+     */
+    static bool parse_float(const char* begin,const char* end,float& out){
+        const char* p=begin;
+        while(p<end&&(*p==' '||*p=='\t')) p++;
+        bool negative=false;
+        if(p<end&&(*p=='+'||*p=='-')){
+            negative=*p=='-';
+            p++;
+        }
+        //整数和小数部分用整数累加,避免逐位浮点乘法的误差累积
+        uint64_t mantissa=0;
+        int exponent=0;
+        int digits=0;
+        for(;p<end&&*p>='0'&&*p<='9';p++,digits++){
+            if(mantissa<100000000000000000ull) mantissa=mantissa*10+(*p-'0');
+            else exponent++;
+        }
+        if(p<end&&*p=='.'){
+            p++;
+            for(;p<end&&*p>='0'&&*p<='9';p++,digits++){
+                if(mantissa<100000000000000000ull){
+                    mantissa=mantissa*10+(*p-'0');
+                    exponent--;
+                }
+            }
+        }
+        if(digits==0) return false;
+        if(p<end&&(*p=='e'||*p=='E')){
+            p++;
+            bool exp_negative=false;
+            if(p<end&&(*p=='+'||*p=='-')){
+                exp_negative=*p=='-';
+                p++;
+            }
+            int exp_value=0;
+            if(p>=end||*p<'0'||*p>'9') return false;
+            for(;p<end&&*p>='0'&&*p<='9';p++){
+                if(exp_value<1000) exp_value=exp_value*10+(*p-'0');
+            }
+            exponent+=exp_negative?-exp_value:exp_value;
+        }
+        while(p<end&&(*p==' '||*p=='\t'||*p=='\r')) p++;
+        if(p!=end) return false;
+        double result=double(mantissa);
+        double scale=10.0;
+        int e=exponent<0?-exponent:exponent;
+        double factor=1.0;
+        while(e){
+            if(e&1) factor*=scale;
+            scale*=scale;
+            e>>=1;
+        }
+        result=exponent<0?result/factor:result*factor;
+        out=float(negative?-result:result);
+        return true;
+    }
+
     static void read_loop(void* p){
+        char line[VOFA_LINE_MAX];
+        size_t len=0;
+        bool overflow=false;
         while(1){
-            if(Serial.available()>0){
-                String str=Serial.readStringUntil('\n');
-                String name=str.substring(0,str.indexOf(':'));
-                float value=str.substring(str.indexOf(':')+1).toFloat();
-                if(name_to_value_map.find(name)!=name_to_value_map.end()){
-                    name_to_value_map[name]->value=value;
+            while(Serial.available()>0){
+                int c=Serial.read();
+                if(c<0) break;
+                if(c=='\n'){
+                    if(!overflow){
+                        //去掉行尾的\r
+                        if(len>0&&line[len-1]=='\r') len--;
+                        handle_command(line,len);
+                    }
+                    len=0;
+                    overflow=false;
+                    continue;
+                }
+                if(len<VOFA_LINE_MAX){
+                    line[len++]=char(c);
                 }else{
-                    Serial.println("VOFA_float: "+name+" not found");
+                    overflow=true;//超长命令整行丢弃
                 }
-                if(on_value_change_callback_list.size()!=0){
-                    for(std::function<void(String,float)> callback:on_value_change_callback_list){
-                        callback(name,value);
-                    }
-                };
-
             }
             delay(1);
         }
 
     };
-    
+
 };
 bool VOFA_float::is_setup=false;
-std::map<String, VOFA_float*>VOFA_float::name_to_value_map;
+VOFA_float* VOFA_float::table[VOFA_TABLE_SIZE]={nullptr};
 std::list<std::function<void(String,float)>>VOFA_float::on_value_change_callback_list;
 
-#endif
\ No newline at end of file
+#endif
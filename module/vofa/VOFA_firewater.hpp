@@ -0,0 +1,200 @@
+#ifndef VOFA_FIREWATER_HPP
+#define VOFA_FIREWATER_HPP
+#include "Arduino.h"
+#include <atomic>
+
+//单个样本最大通道数
+#ifndef VOFA_FIREWATER_MAX_CHANNEL
+#define VOFA_FIREWATER_MAX_CHANNEL 16
+#endif
+
+//样本队列长度,必须是2的幂
+#ifndef VOFA_FIREWATER_QUEUE_SIZE
+#define VOFA_FIREWATER_QUEUE_SIZE 64
+#endif
+
+//格式化缓冲区大小,决定一次写入串口的最大数据量
+#ifndef VOFA_FIREWATER_BUFFER_SIZE
+#define VOFA_FIREWATER_BUFFER_SIZE 1024
+#endif
+
+/**
+ * @brief VOFA+ FireWater协议文本数据发送
+ * @note  控制循环只把原始float压入无锁队列,浮点数转文本和串口写入都在低优先级任务中完成。
+ *        队列为单生产者单消费者,同一对象只能在一个任务中调用push
+ */
+class VOFA_firewater{
+    public:
+    /**
+     * @param _serial 输出串口
+     * @param _precision 小数位数,0-6
+     */
+    VOFA_firewater(HardwareSerial* _serial=&Serial,int _precision=3):serial(_serial){
+        precision=_precision<0?0:(_precision>6?6:_precision);
+        scale=1;
+        for(int i=0;i<precision;i++) scale*=10;
+    }
+    VOFA_firewater(const VOFA_firewater&)=delete;
+    VOFA_firewater& operator=(const VOFA_firewater&)=delete;
+    ~VOFA_firewater(){
+        if(task_handle!=nullptr) vTaskDelete(task_handle);
+    }
+
+    /**
+     * @brief 启动格式化任务
+     * @param priority 格式化任务优先级,应低于控制任务
+     * @param core 运行的核心
+     */
+    void setup(UBaseType_t priority=1,int core=tskNO_AFFINITY){
+        if(task_handle!=nullptr) return;
+        xTaskCreatePinnedToCore(format_task,"vofa_firewater",4096,this,priority,&task_handle,core);
+    }
+
+    /**
+     * @brief 压入一个样本,只拷贝原始数据,不做格式化
+     * @param values 通道数据
+     * @param n 通道数,超过VOFA_FIREWATER_MAX_CHANNEL的部分被忽略
+     * @return 队列满时返回false,样本被丢弃
+     */
+    bool push(const float* values,int n){
+        uint32_t start=ESP.getCycleCount();
+        uint32_t head=queue_head.load(std::memory_order_relaxed);
+        if(head-queue_tail.load(std::memory_order_acquire)>=VOFA_FIREWATER_QUEUE_SIZE){
+            dropped_samples++;
+            return false;
+        }
+        sample_t& sample=queue[head&(VOFA_FIREWATER_QUEUE_SIZE-1)];
+        if(n>VOFA_FIREWATER_MAX_CHANNEL) n=VOFA_FIREWATER_MAX_CHANNEL;
+        sample.channel_num=n;
+        memcpy(sample.value,values,n*sizeof(float));
+        queue_head.store(head+1,std::memory_order_release);
+        if(task_handle!=nullptr) xTaskNotifyGive(task_handle);
+        //统计控制循环一侧的开销
+        uint32_t cycles=ESP.getCycleCount()-start;
+        push_cycles_sum+=cycles;
+        push_count++;
+        if(cycles>push_cycles_max) push_cycles_max=cycles;
+        return true;
+    }
+
+    //以可变参数压入一个样本,例如 push(target,speed,current)
+    template<typename... Args>
+    bool push(float first,Args... args){
+        const float values[]={first,float(args)...};
+        return push(values,int(1+sizeof...(Args)));
+    }
+
+    //因队列满丢弃的样本数
+    uint32_t get_dropped_samples(){return dropped_samples;}
+    //push的平均开销,单位CPU周期
+    uint32_t get_push_cycles_avg(){return push_count?uint32_t(push_cycles_sum/push_count):0;}
+    //push的最大开销,单位CPU周期
+    uint32_t get_push_cycles_max(){return push_cycles_max;}
+    //清空统计
+    void reset_stats(){
+        push_cycles_sum=0;
+        push_count=0;
+        push_cycles_max=0;
+        dropped_samples=0;
+    }
+
+    /**
+     * @brief 定点格式化浮点数,比printf快得多
+     * @param out 输出缓冲区,至少24字节
+     * @param value 数值
+     * @param precision 小数位数
+     * @param scale 10的precision次方
+     * @return 写入的字节数
+     */
+    static int format_float(char* out,float value,int precision,uint32_t scale){
+        if(isnan(value)){
+            memcpy(out,"nan",3);
+            return 3;
+        }
+        char* p=out;
+        if(value<0){
+            *p++='-';
+            value=-value;
+        }
+        if(isinf(value)){
+            memcpy(p,"inf",3);
+            return p-out+3;
+        }
+        if(value>=4294967295.f){
+            //超出定点范围时退回科学计数法,很少出现
+            return p-out+sprintf(p,"%.*e",precision,value);
+        }
+        //四舍五入到指定位数后拆成整数和小数部分
+        uint64_t fixed=uint64_t(double(value)*scale+0.5);
+        uint32_t integer=uint32_t(fixed/scale);
+        uint32_t fraction=uint32_t(fixed%scale);
+        char digits[10];
+        int n=0;
+        do{
+            digits[n++]='0'+integer%10;
+            integer/=10;
+        }while(integer);
+        while(n) *p++=digits[--n];
+        if(precision>0){
+            *p++='.';
+            for(int i=precision-1;i>=0;i--){
+                p[i]='0'+fraction%10;
+                fraction/=10;
+            }
+            p+=precision;
+        }
+        return p-out;
+    }
+
+    protected:
+    struct sample_t{
+        uint8_t channel_num;
+        float value[VOFA_FIREWATER_MAX_CHANNEL];
+    };
+
+    static void format_task(void* arg){
+        VOFA_firewater* obj=(VOFA_firewater*)arg;
+        char* buffer=obj->buffer;
+        //一行最大长度:每个数最多 符号+10位整数+小数点+6位小数 加分隔符
+        const int max_line=VOFA_FIREWATER_MAX_CHANNEL*19+1;
+        static_assert(VOFA_FIREWATER_BUFFER_SIZE>=VOFA_FIREWATER_MAX_CHANNEL*19+1,"VOFA_FIREWATER_BUFFER_SIZE too small");
+        while(1){
+            ulTaskNotifyTake(pdTRUE,portMAX_DELAY);
+            int len=0;
+            while(1){
+                uint32_t tail=obj->queue_tail.load(std::memory_order_relaxed);
+                bool empty=tail==obj->queue_head.load(std::memory_order_acquire);
+                //队列取空或缓冲区放不下下一行时整块写出
+                if(empty||len+max_line>VOFA_FIREWATER_BUFFER_SIZE){
+                    if(len>0){
+                        obj->serial->write((const uint8_t*)buffer,len);
+                        len=0;
+                    }
+                    if(empty) break;
+                }
+                sample_t& sample=obj->queue[tail&(VOFA_FIREWATER_QUEUE_SIZE-1)];
+                for(int i=0;i<sample.channel_num;i++){
+                    if(i) buffer[len++]=',';
+                    len+=format_float(buffer+len,sample.value[i],obj->precision,obj->scale);
+                }
+                buffer[len++]='\n';
+                obj->queue_tail.store(tail+1,std::memory_order_release);
+            }
+        }
+    }
+
+    HardwareSerial* serial;
+    int precision;
+    uint32_t scale;
+    sample_t queue[VOFA_FIREWATER_QUEUE_SIZE];
+    char buffer[VOFA_FIREWATER_BUFFER_SIZE];//格式化缓冲区,放在对象中,不占格式化任务的栈
+    std::atomic<uint32_t> queue_head{0};
+    std::atomic<uint32_t> queue_tail{0};
+    volatile uint32_t dropped_samples=0;
+    uint64_t push_cycles_sum=0;
+    uint32_t push_count=0;
+    uint32_t push_cycles_max=0;
+    TaskHandle_t task_handle=nullptr;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef VOFA_STREAM_HPP
+#define VOFA_STREAM_HPP
+#include "Arduino.h"
+#include "esp_timer.h"
+#include <functional>
+
+//最大通道数
+#ifndef VOFA_STREAM_MAX_CHANNEL
+#define VOFA_STREAM_MAX_CHANNEL 32
+#endif
+
+//单个发送缓冲区最大字节数,决定一次写入串口的最大数据量
+#ifndef VOFA_STREAM_BUFFER_SIZE
+#define VOFA_STREAM_BUFFER_SIZE 2048
+#endif
+
+/**
+ * @brief VOFA+ JustFloat协议数据流发送
+ * @note  定时器按固定频率采样已注册的通道,打包为JustFloat帧(小端float + 帧尾0x7F800000),
+ *        多帧攒成一批后整块交给串口驱动发送,发送在独立任务中完成,不阻塞控制任务
+ */
+class VOFA_stream{
+    public:
+    VOFA_stream(HardwareSerial* _serial=&Serial):serial(_serial){}
+    VOFA_stream(const VOFA_stream&)=delete;
+    VOFA_stream& operator=(const VOFA_stream&)=delete;
+    ~VOFA_stream(){
+        stop();
+        free(buffer[0]);
+        free(buffer[1]);
+    }
+
+    /**
+     * @brief 添加通道,采样时直接读取该地址的值,需在setup前调用
+     * @param value 变量地址,需保证在发送期间有效
+     * @return 是否添加成功
+     */
+    bool add_channel(const float* value){
+        if(is_setup||channel_num>=VOFA_STREAM_MAX_CHANNEL) return false;
+        channel_ptr[channel_num]=value;
+        channel_func[channel_num]=nullptr;
+        channel_num++;
+        return true;
+    }
+    /**
+     * @brief 添加通道,采样时调用该函数获取值,需在setup前调用
+     * @param func 获取通道值的函数,在esp_timer任务中调用,不能阻塞
+     * @return 是否添加成功
+     */
+    bool add_channel(std::function<float()> func){
+        if(is_setup||channel_num>=VOFA_STREAM_MAX_CHANNEL) return false;
+        channel_ptr[channel_num]=nullptr;
+        channel_func[channel_num]=func;
+        channel_num++;
+        return true;
+    }
+
+    /**
+     * @brief 启动采样和发送
+     * @param frequency 采样频率,单位Hz
+     * @param batch_frames 每次写入串口的帧数,0为自动(约每10ms写一次)
+     * @param priority 发送任务优先级
+     */
+    void setup(int frequency=1000,int batch_frames=0,UBaseType_t priority=1){
+        if(is_setup||channel_num==0||frequency<=0) return;
+        frame_size=channel_num*4+4;
+        if(batch_frames<=0) batch_frames=frequency/100;
+        int max_batch=VOFA_STREAM_BUFFER_SIZE/frame_size;
+        if(batch_frames>max_batch) batch_frames=max_batch;
+        if(batch_frames<1) batch_frames=1;
+        batch=batch_frames;
+        frame_count=0;
+        free(buffer[0]);
+        free(buffer[1]);
+        buffer[0]=(uint8_t*)malloc(batch*frame_size);
+        buffer[1]=(uint8_t*)malloc(batch*frame_size);
+        if(buffer[0]==nullptr||buffer[1]==nullptr){
+            log_e("VOFA_stream: buffer alloc failed");
+            return;
+        }
+        is_setup=true;
+        xTaskCreate(write_task,"vofa_stream",2048,this,priority,&write_task_handle);
+        esp_timer_create_args_t timer_args={};
+        timer_args.callback=sample_callback;
+        timer_args.arg=this;
+        timer_args.dispatch_method=ESP_TIMER_TASK;
+        timer_args.name="vofa_stream";
+        esp_timer_create(&timer_args,&timer);
+        esp_timer_start_periodic(timer,1000000/frequency);
+    }
+
+    //停止采样和发送
+    void stop(){
+        if(!is_setup) return;
+        esp_timer_stop(timer);
+        esp_timer_delete(timer);
+        vTaskDelete(write_task_handle);
+        is_setup=false;
+    }
+
+    //因串口来不及发送而丢弃的帧数
+    uint32_t get_dropped_frames(){return dropped_frames;}
+    //已发送帧数
+    uint32_t get_sent_frames(){return sent_frames;}
+
+    protected:
+    //定时采样,在esp_timer任务中运行
+    static void sample_callback(void* arg){
+        VOFA_stream* obj=(VOFA_stream*)arg;
+        uint8_t* frame=obj->buffer[obj->active]+obj->frame_count*obj->frame_size;
+        for(int i=0;i<obj->channel_num;i++){
+            float value=obj->channel_ptr[i]?*obj->channel_ptr[i]:obj->channel_func[i]();
+            //ESP32为小端,直接拷贝即为JustFloat要求的字节序
+            memcpy(frame+i*4,&value,4);
+        }
+        //帧尾0x7F800000,小端存储为00 00 80 7F
+        const uint32_t tail=0x7F800000;
+        memcpy(frame+obj->channel_num*4,&tail,4);
+        obj->frame_count++;
+        if(obj->frame_count<obj->batch) return;
+        obj->frame_count=0;
+        if(obj->writing){
+            //上一批还没发完,丢弃本批
+            obj->dropped_frames+=obj->batch;
+            return;
+        }
+        //交换缓冲区并通知发送任务
+        obj->writing=true;
+        obj->active^=1;
+        xTaskNotifyGive(obj->write_task_handle);
+    }
+
+    static void write_task(void* arg){
+        VOFA_stream* obj=(VOFA_stream*)arg;
+        while(1){
+            ulTaskNotifyTake(pdTRUE,portMAX_DELAY);
+            //发送非活动缓冲区,一次写入整批数据
+            obj->serial->write(obj->buffer[obj->active^1],obj->batch*obj->frame_size);
+            obj->sent_frames+=obj->batch;
+            obj->writing=false;
+        }
+    }
+
+    HardwareSerial* serial;
+    const float* channel_ptr[VOFA_STREAM_MAX_CHANNEL];
+    std::function<float()> channel_func[VOFA_STREAM_MAX_CHANNEL];
+    int channel_num=0;
+    int frame_size=0;
+    int batch=1;
+    //双缓冲,active为采样写入的缓冲区
+    uint8_t* buffer[2]={nullptr,nullptr};
+    volatile uint8_t active=0;
+    int frame_count=0;
+    volatile bool writing=false;
+    volatile uint32_t dropped_frames=0;
+    volatile uint32_t sent_frames=0;
+    bool is_setup=false;
+    esp_timer_handle_t timer=nullptr;
+    TaskHandle_t write_task_handle=nullptr;
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "VECTOR3.hpp"
 #include <functional>
+#include <HXC_std_err_def.h>
 
 class AccelerationControl {
 public:
@@ -28,8 +29,8 @@ public:
     vec3<float> get_speed(vec3<float> speed_vector){
         // 获取当前时间（单位：微秒）
         uint64_t now_time_us = get_now_time_us_func();
-        // 计算时间差（单位：秒）
-        float delta_time_s = 1e-6*(now_time_us - last_time_us);
+        // 计算时间差（单位：秒），自定义时间源回绕时本次不允许速度变化
+        float delta_time_s = now_time_us > last_time_us ? 1e-6f*(now_time_us - last_time_us) : 0.f;
         // 更新上一次记录的时间
         last_time_us = now_time_us;
         // 计算在当前时间间隔内允许的最大速度变化量
@@ -76,6 +77,7 @@ public:
      * 函数指针或 lambda 表达式的类型为 std::function<uint64_t()>，表示返回 uint64_t 类型的函数。
      * 
      * @param func 一个 std::function<uint64_t()> 类型的函数指针或 lambda 表达式，用于获取当前时间
+     * @note 默认已使用now_time_us()，只在仿真或测试时需要替换；应为64位单调时间，不要使用32位的micros()
      */
     void set_get_now_time_us_func(std::function<uint64_t()> func) { 
         get_now_time_us_func = func; 
@@ -87,15 +89,13 @@ protected:
      * 
      * 该函数返回当前时间，单位为微秒。
      * 函数指针或 lambda 表达式的类型为 std::function<uint64_t()>，表示返回 uint64_t 类型的函数。
-     * @note 默认函数每次调用加 1e4 微秒
+     * @note 默认使用HXC_std_err_def.h中的now_time_us()
      * @return uint64_t 当前时间，单位为微秒
      */
     std::function<uint64_t()> get_now_time_us_func=[](){
-        static uint64_t now_time_us = 0;
-        now_time_us+=1e4;
-        return now_time_us;
+        return uint64_t(now_time_us());
     };
-    uint64_t last_time_us = 0;
+    uint64_t last_time_us = uint64_t(now_time_us());
     vec3<float> last_speed=vec3<float>(0,0,0);
     vec3<float> acceleration=vec3<float>(0,0,0);
     